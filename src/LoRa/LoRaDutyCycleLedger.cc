@@ -0,0 +1,117 @@
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+// 
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see http://www.gnu.org/licenses/.
+// 
+
+
+#include "LoRaDutyCycleLedger.h"
+
+namespace flora_tdma {
+
+// ETSI EN 300 220 sub-bands used by LoRaWAN EU868
+static const LoRaDutyCycleLedger::SubBand subBands[] = {
+    { 863.0, 865.0, 0.001, "863.0-865.0MHz" },
+    { 865.0, 868.0, 0.01, "865.0-868.0MHz" },
+    { 868.0, 868.6, 0.01, "868.0-868.6MHz" },
+    { 868.7, 869.2, 0.001, "868.7-869.2MHz" },
+    { 869.4, 869.65, 0.1, "869.4-869.65MHz" },
+    { 869.7, 870.0, 0.01, "869.7-870.0MHz" },
+};
+static const int numSubBands = sizeof(subBands) / sizeof(subBands[0]);
+
+LoRaDutyCycleLedger::LoRaDutyCycleLedger() :
+    usage(numSubBands)
+{
+}
+
+int LoRaDutyCycleLedger::getSubBand(Hz frequency)
+{
+    double mhz = MHz(frequency).get();
+    for (int i = 0; i < numSubBands; i++) {
+        if (mhz >= subBands[i].low && mhz < subBands[i].high)
+            return i;
+    }
+    return -1;
+}
+
+double LoRaDutyCycleLedger::getDutyCycle(Hz frequency)
+{
+    int subBand = getSubBand(frequency);
+    return subBand >= 0 ? subBands[subBand].dutyCycle : 1;
+}
+
+void LoRaDutyCycleLedger::expire(Usage& subBandUsage, simtime_t now)
+{
+    while (!subBandUsage.transmissions.empty() && subBandUsage.transmissions.front().first + subBandUsage.transmissions.front().second <= now - window) {
+        subBandUsage.windowAirtime -= subBandUsage.transmissions.front().second;
+        subBandUsage.transmissions.pop_front();
+    }
+}
+
+bool LoRaDutyCycleLedger::recordTransmission(Hz frequency, simtime_t start, simtime_t airtime)
+{
+    int subBand = getSubBand(frequency);
+    if (subBand < 0)
+        return true;
+
+    Usage& subBandUsage = usage[subBand];
+    expire(subBandUsage, start + airtime);
+    subBandUsage.transmissions.push_back({start, airtime});
+    subBandUsage.windowAirtime += airtime;
+    subBandUsage.totalAirtime += airtime;
+    subBandUsage.availableAt = std::max(subBandUsage.availableAt, start + airtime / subBands[subBand].dutyCycle);
+
+    double share = subBandUsage.windowAirtime.dbl() / (window.dbl() * subBands[subBand].dutyCycle);
+    subBandUsage.maxUsage = std::max(subBandUsage.maxUsage, share);
+    if (share > 1) {
+        subBandUsage.numViolations++;
+        return false;
+    }
+    return true;
+}
+
+simtime_t LoRaDutyCycleLedger::getAvailableAt(Hz frequency) const
+{
+    int subBand = getSubBand(frequency);
+    return subBand >= 0 ? usage[subBand].availableAt : SIMTIME_ZERO;
+}
+
+simtime_t LoRaDutyCycleLedger::getWindowAirtime(Hz frequency, simtime_t now)
+{
+    int subBand = getSubBand(frequency);
+    if (subBand < 0)
+        return SIMTIME_ZERO;
+    expire(usage[subBand], now);
+    return usage[subBand].windowAirtime;
+}
+
+long LoRaDutyCycleLedger::getNumViolations() const
+{
+    long numViolations = 0;
+    for (auto& subBandUsage : usage)
+        numViolations += subBandUsage.numViolations;
+    return numViolations;
+}
+
+void LoRaDutyCycleLedger::recordScalars(cComponent *owner) const
+{
+    owner->recordScalar("dutyCycleViolations", getNumViolations());
+    for (int i = 0; i < numSubBands; i++) {
+        if (usage[i].totalAirtime == SIMTIME_ZERO)
+            continue;
+        owner->recordScalar((std::string("dutyCycleAirtime ") + subBands[i].name).c_str(), usage[i].totalAirtime);
+        owner->recordScalar((std::string("dutyCycleMaxUsage ") + subBands[i].name).c_str(), usage[i].maxUsage);
+    }
+}
+
+}
@@ -0,0 +1,85 @@
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+// 
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see http://www.gnu.org/licenses/.
+// 
+
+
+#ifndef LORA_LORADUTYCYCLELEDGER_H_
+#define LORA_LORADUTYCYCLELEDGER_H_
+
+#include "inet/common/INETDefs.h"
+#include "inet/common/Units.h"
+#include <deque>
+#include <vector>
+
+namespace flora_tdma {
+
+using namespace inet;
+using namespace inet::units::values;
+
+/**
+ * Airtime ledger of one radio over the EU868 duty-cycle sub-bands.
+ *
+ * Transmissions are checked against the sliding observation window of the
+ * regulation, and a violation is counted whenever a sub-band's budget is
+ * exceeded. For planning, every transmission also closes its sub-band for
+ * airtime / dutyCycle from its start (the LoRaWAN off-time rule), which is
+ * enough to never exceed the budget of the window.
+ */
+class LoRaDutyCycleLedger
+{
+  public:
+    struct SubBand {
+        double low; // MHz
+        double high; // MHz
+        double dutyCycle;
+        const char *name;
+    };
+
+  protected:
+    struct Usage {
+        std::deque<std::pair<simtime_t, simtime_t>> transmissions; // Start and airtime of those still in the window
+        simtime_t windowAirtime = 0;
+        simtime_t totalAirtime = 0;
+        simtime_t availableAt = 0; // End of the off-time of the last transmission
+        double maxUsage = 0; // Highest share of the budget used within a window
+        long numViolations = 0;
+    };
+
+    simtime_t window = 3600;
+    std::vector<Usage> usage; // Per sub-band
+
+    virtual void expire(Usage& subBandUsage, simtime_t now);
+
+  public:
+    LoRaDutyCycleLedger();
+    virtual ~LoRaDutyCycleLedger() {}
+
+    virtual void setWindow(simtime_t window) { this->window = window; }
+
+    static int getSubBand(Hz frequency); // -1 outside the regulated sub-bands
+    static double getDutyCycle(Hz frequency); // 1 outside the regulated sub-bands
+
+    /** Returns false if the transmission exceeds the budget of its sub-band. */
+    virtual bool recordTransmission(Hz frequency, simtime_t start, simtime_t airtime);
+    /** Earliest time a new transmission keeps to the off-time rule. */
+    virtual simtime_t getAvailableAt(Hz frequency) const;
+    virtual simtime_t getWindowAirtime(Hz frequency, simtime_t now);
+    virtual long getNumViolations() const;
+
+    virtual void recordScalars(cComponent *owner) const;
+};
+
+}
+
+#endif /* LORA_LORADUTYCYCLELEDGER_H_ */
@@ -17,6 +17,7 @@
 #include "LoRaPhy/LoRaMedium.h"
 #include "LoRaPhy/LoRaPhyPreamble_m.h"
 #include "inet/physicallayer/wireless/common/contract/packetlevel/SignalTag_m.h"
+#include <algorithm>
 
 
 namespace flora_tdma {
@@ -27,7 +28,26 @@ void LoRaGWRadio::initialize(int stage)
 {
     FlatRadioBase::initialize(stage);
     iAmGateway = par("iAmGateway").boolValue();
-    if (stage == INITSTAGE_LAST) {
+    if (stage == INITSTAGE_LOCAL) {
+        for (auto frequency : cStringTokenizer(par("channelFrequencies")).asDoubleVector())
+            channelFrequencies.push_back(MHz(frequency));
+        if (channelFrequencies.empty())
+            throw cRuntimeError("At least one channel is required in channelFrequencies");
+        beaconFrequency = Hz(par("beaconFrequency"));
+        dutyCycleLedger.setWindow(par("dutyCycleWindow"));
+
+        /* Our noise model cannot handle partly overlapping bands, so neither can the channel plan */
+        Hz bandwidth = Hz(beaconBandwidth);
+        for (size_t i = 0; i < channelFrequencies.size(); i++) {
+            for (size_t j = i + 1; j < channelFrequencies.size(); j++) {
+                if (abs(channelFrequencies[i] - channelFrequencies[j]) < bandwidth)
+                    throw cRuntimeError("Channels %s and %s overlap", channelFrequencies[i].str().c_str(), channelFrequencies[j].str().c_str());
+            }
+            if (channelFrequencies[i] != beaconFrequency && abs(channelFrequencies[i] - beaconFrequency) < bandwidth)
+                throw cRuntimeError("Channel %s overlaps the beacon channel %s", channelFrequencies[i].str().c_str(), beaconFrequency.str().c_str());
+        }
+    }
+    else if (stage == INITSTAGE_LAST) {
         setRadioMode(RADIO_MODE_TRANSCEIVER);
         LoRaGWRadioReceptionStarted = registerSignal("LoRaGWRadioReceptionStarted");
         LoRaGWRadioReceptionFinishedCorrect = registerSignal("LoRaGWRadioReceptionFinishedCorrect");
@@ -42,6 +62,7 @@ void LoRaGWRadio::finish()
     /* Used to clean up */
     FlatRadioBase::finish();
     recordScalar("DER - Data Extraction Rate", double(LoRaGWRadioReceptionFinishedCorrect_counter)/LoRaGWRadioReceptionStarted_counter);
+    dutyCycleLedger.recordScalars(this);
 }
 
 void LoRaGWRadio::handleSelfMessage(cMessage *message)
@@ -64,6 +85,11 @@ void LoRaGWRadio::handleSelfMessage(cMessage *message)
 }
 
 
+bool LoRaGWRadio::isListeningOn(Hz centerFrequency) const
+{
+    return std::find(channelFrequencies.begin(), channelFrequencies.end(), centerFrequency) != channelFrequencies.end();
+}
+
 bool LoRaGWRadio::isTransmissionTimer(const cMessage *message) const
 {
     return !strcmp(message->getName(), "transmissionTimer");
@@ -97,11 +123,11 @@ void LoRaGWRadio::handleUpperPacket(Packet *packet)
     auto preamble = makeShared<LoRaPhyPreamble>();
 
     // TODO: fix later
-    preamble->setBandwidth(kHz(125));
-    preamble->setCenterFrequency(MHz(868));
-    preamble->setCodeRendundance(4);
+    preamble->setBandwidth(Hz(beaconBandwidth));
+    preamble->setCenterFrequency(beaconFrequency);
+    preamble->setCodeRendundance(beaconCodeRendundance);
     preamble->setPower(mW(math::dBmW2mW(14)));
-    preamble->setSpreadFactor(12);
+    preamble->setSpreadFactor(beaconSpreadFactor);
     preamble->setUseHeader(true);
     preamble->setReceiverAddress(MacAddress::BROADCAST_ADDRESS);
 
@@ -134,6 +160,8 @@ void LoRaGWRadio::startTransmission(Packet *packet, IRadioSignal::SignalPart par
     iAmTransmiting = true;
     auto radioFrame = createSignal(packet);
     auto transmission = radioFrame->getTransmission();
+    if (!dutyCycleLedger.recordTransmission(beaconFrequency, transmission->getStartTime(), transmission->getDuration()))
+        EV_WARN << "Beacon on " << beaconFrequency << " exceeds the duty-cycle budget" << endl;
 
     /* Notify ourself when this transmission ends*/
     cMessage *txTimer = new cMessage("transmissionTimer");
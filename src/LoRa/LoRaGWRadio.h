@@ -25,6 +25,7 @@
 #include "inet/physicallayer/wireless/common//medium/RadioMedium.h"
 #include "LoRaPhy/LoRaMedium.h"
 #include "inet/common/LayeredProtocolBase.h"
+#include "LoRaDutyCycleLedger.h"
 
 namespace flora_tdma {
 
@@ -39,6 +40,7 @@ protected:
     void handleSignal(WirelessSignal *radioFrame) override;
 
     bool iAmTransmiting;
+    LoRaDutyCycleLedger dutyCycleLedger;
     virtual bool isTransmissionTimer(const cMessage *message) const;
     virtual void handleTransmissionTimer(cMessage *message) override;
     virtual void startTransmission(Packet *macFrame, IRadioSignal::SignalPart part) override;
@@ -53,8 +55,19 @@ protected:
 
 
 public:
+    /* PHY settings of the beacon, the MAC needs them to know how long it is on air */
+    static constexpr int beaconSpreadFactor = 12;
+    static constexpr double beaconBandwidth = 125000; // Hz
+    static constexpr int beaconCodeRendundance = 4;
+
     bool iAmGateway;
 
+    /* Uplink channels we receive on, all at the same time */
+    std::vector<Hz> channelFrequencies;
+    Hz beaconFrequency;
+    virtual bool isListeningOn(Hz centerFrequency) const;
+    virtual LoRaDutyCycleLedger& getDutyCycleLedger() { return dutyCycleLedger; }
+
     std::list<cMessage *>concurrentReceptions;
     std::list<cMessage *>concurrentTransmissions;
 
@@ -26,6 +26,7 @@
 #include "LoRaTagInfo_m.h"
 #include "../LoRaPhy/LoRaPhyPreamble_m.h"
 #include "inet/physicallayer/wireless/common/contract/packetlevel/SignalTag_m.h"
+#include "inet/physicallayer/wireless/common/signal/WirelessSignal.h"
 
 /* Almost the same as LoRaGWRadio.cc */
 
@@ -46,9 +47,16 @@ void LoRaRadio::initialize(int stage)
     if (stage == INITSTAGE_LOCAL) {
         iAmGateway = par("iAmGateway").boolValue();
         loRaTP = 14;
+        dutyCycleLedger.setWindow(par("dutyCycleWindow"));
     }
 }
 
+void LoRaRadio::finish()
+{
+    NarrowbandRadioBase::finish();
+    dutyCycleLedger.recordScalars(this);
+}
+
 LoRaRadio::~LoRaRadio() {
 }
 
@@ -124,6 +132,12 @@ void LoRaRadio::handleUpperPacket(Packet *packet)
             startTransmission(packet, IRadioSignal::SIGNAL_PART_PREAMBLE);
         else
             startTransmission(packet, IRadioSignal::SIGNAL_PART_WHOLE);
+
+        // Only the transmitter knows how long the frame is on air
+        auto signal = static_cast<WirelessSignal *>(transmissionTimer->getContextPointer());
+        auto transmission = signal->getTransmission();
+        if (!dutyCycleLedger.recordTransmission(preamble->getCenterFrequency(), transmission->getStartTime(), transmission->getDuration()))
+            EV_WARN << "Transmission on " << preamble->getCenterFrequency() << " exceeds the duty-cycle budget" << endl;
     }
     else {
         EV_ERROR << "Radio is not in transmitter or transceiver mode, dropping frame." << endl;
@@ -22,6 +22,7 @@
 #include "inet/physicallayer/wireless/common/contract/packetlevel/IRadio.h"
 #include "inet/physicallayer/wireless/common/contract/packetlevel/IRadioMedium.h"
 #include "inet/physicallayer/wireless/common/base/packetlevel/NarrowbandRadioBase.h"
+#include "LoRaDutyCycleLedger.h"
 
 using namespace inet;
 using namespace inet::physicallayer;
@@ -55,7 +56,10 @@ private:
   void startRadioModeSwitch(RadioMode newRadioMode, simtime_t switchingTime);
 
 protected:
+  LoRaDutyCycleLedger dutyCycleLedger;
+
   virtual void initialize(int stage) override;
+  virtual void finish() override;
 
   virtual void handleMessageWhenDown(cMessage *message) override;
   virtual void handleMessageWhenUp(cMessage *message) override;
@@ -71,6 +75,8 @@ public:
 
   std::list<cMessage *>concurrentReceptions;
 
+  virtual LoRaDutyCycleLedger& getDutyCycleLedger() { return dutyCycleLedger; }
+
   virtual int getId() const override { return id; }
 
   virtual std::ostream& printToStream(std::ostream& stream, int level, int evFlags = 0) const override;
@@ -0,0 +1,44 @@
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+// 
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see http://www.gnu.org/licenses/.
+// 
+
+
+#include "LoRaTDMAClientRegistry.h"
+
+namespace flora_tdma {
+
+int LoRaTDMAClientRegistry::add(const MacAddress& address)
+{
+    auto result = ids.emplace(address.getInt(), clients.size());
+    if (result.second) {
+        LoRaTDMAClient client;
+        client.address = address;
+        clients.push_back(client);
+    }
+    return result.first->second;
+}
+
+int LoRaTDMAClientRegistry::find(const MacAddress& address) const
+{
+    auto it = ids.find(address.getInt());
+    return it != ids.end() ? it->second : -1;
+}
+
+void LoRaTDMAClientRegistry::reserve(size_t numClients)
+{
+    clients.reserve(numClients);
+    ids.reserve(numClients);
+}
+
+}
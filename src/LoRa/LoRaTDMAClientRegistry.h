@@ -0,0 +1,71 @@
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+// 
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see http://www.gnu.org/licenses/.
+// 
+
+
+#ifndef LORA_LORATDMACLIENTREGISTRY_H_
+#define LORA_LORATDMACLIENTREGISTRY_H_
+
+#include "inet/common/INETDefs.h"
+#include "inet/linklayer/common/MacAddress.h"
+#include "LoRaTDMAMacFrame_m.h"
+#include <unordered_map>
+#include <vector>
+
+namespace flora_tdma {
+
+using namespace inet;
+
+/* What the gateway knows about one of its nodes */
+struct LoRaTDMAClient {
+    MacAddress address;
+    int backlog = -1; // Last reported backlog, -1 if never heard
+    int driftClass = DRIFT_CLASSES - 1; // Last reported drift class
+    int maxPayloadBytes = -1; // Size of the largest uplink so far, -1 if never heard
+    double rssi = NaN; // Smoothed uplink RSSI in dBm, NaN if never heard
+    int spreadFactor = 12; // Lowest SF the link allows, from the RSSI
+    simtime_t lastHeard = -1; // Last uplink, -1 if never heard
+};
+
+/**
+ * The nodes of a gateway, in registration order.
+ *
+ * The index of a client is its short ID in the beacon and never changes.
+ * Addresses are looked up through a hash map, so the registry stays cheap
+ * for cells far beyond what fits in a single beacon.
+ */
+class LoRaTDMAClientRegistry
+{
+  protected:
+    std::vector<LoRaTDMAClient> clients;
+    std::unordered_map<uint64_t, int> ids; // MAC address to index
+
+  public:
+    /** Returns the index of the new client, or the existing one if it is already registered. */
+    virtual int add(const MacAddress& address);
+    /** Returns -1 for unknown addresses. */
+    virtual int find(const MacAddress& address) const;
+    virtual void reserve(size_t numClients);
+
+    int size() const { return clients.size(); }
+    bool empty() const { return clients.empty(); }
+    LoRaTDMAClient& operator[](int index) { return clients[index]; }
+    const LoRaTDMAClient& operator[](int index) const { return clients[index]; }
+    std::vector<LoRaTDMAClient>::const_iterator begin() const { return clients.begin(); }
+    std::vector<LoRaTDMAClient>::const_iterator end() const { return clients.end(); }
+};
+
+}
+
+#endif /* LORA_LORATDMACLIENTREGISTRY_H_ */
@@ -0,0 +1,242 @@
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+// 
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see http://www.gnu.org/licenses/.
+// 
+
+
+#include "LoRaTDMAClusterScheduler.h"
+#include "inet/mobility/contract/IMobility.h"
+#include "inet/physicallayer/wireless/common/contract/packetlevel/IRadioMedium.h"
+#include "inet/physicallayer/wireless/common/contract/packetlevel/IMediumLimitCache.h"
+#include <algorithm>
+
+namespace flora_tdma {
+
+Define_Module(LoRaTDMAClusterScheduler);
+
+void LoRaTDMAClusterScheduler::initialize()
+{
+    reuseDistanceFactor = par("reuseDistanceFactor");
+    if (reuseDistanceFactor <= 0)
+        throw cRuntimeError("Invalid reuseDistanceFactor = %g", reuseDistanceFactor);
+    numReused = 0;
+    numMoved = 0;
+    numDropped = 0;
+}
+
+void LoRaTDMAClusterScheduler::finish()
+{
+    recordScalar("reusedTimeSlots", numReused);
+    recordScalar("movedTimeSlots", numMoved);
+    recordScalar("droppedTimeSlots", numDropped);
+}
+
+void LoRaTDMAClusterScheduler::handleMessage(cMessage *msg)
+{
+    throw cRuntimeError("LoRaTDMAClusterScheduler does not handle messages");
+}
+
+int LoRaTDMAClusterScheduler::registerGateway(LoRaTDMAGWMac *gatewayMac)
+{
+    // The first gateway to register has the whole network looked up, the others only find their index
+    if (!discovered)
+        discoverNetwork(gatewayMac->radio);
+    auto it = std::find(gateways.begin(), gateways.end(), gatewayMac);
+    if (it == gateways.end())
+        throw cRuntimeError("Gateway %s is not part of the network", gatewayMac->getFullPath().c_str());
+    return it - gateways.begin();
+}
+
+void LoRaTDMAClusterScheduler::discoverNetwork(const IRadio *gatewayRadio)
+{
+    discovered = true;
+    reuseDistance = m(par("reuseDistance"));
+    if (reuseDistance < m(0)) {
+        // As far as the strongest transmitter can be heard on the medium's path loss model
+        reuseDistance = reuseDistanceFactor * gatewayRadio->getMedium()->getMediumLimitCache()->getMaxCommunicationRange(gatewayRadio);
+    }
+    EV << "Reuse distance: " << reuseDistance << endl;
+
+    std::vector<Coord> gatewayPositions;
+    std::vector<std::pair<LoRaTDMAMac *, Coord>> nodes;
+    cModule *network = cSimulation::getActiveSimulation()->getSystemModule();
+    for (SubmoduleIterator it(network); !it.end(); ++it) {
+        cModule *mod = *it;
+        cModule *mobilityMod = mod->getSubmodule("mobility");
+        if (mobilityMod == nullptr)
+            continue;
+        Coord position = check_and_cast<IMobility *>(mobilityMod)->getCurrentPosition();
+
+        cModule *gwNicMod = mod->getSubmodule("LoRaGWNic");
+        if (gwNicMod != nullptr) {
+            LoRaTDMAGWMac *gatewayMac = dynamic_cast<LoRaTDMAGWMac *>(gwNicMod->getSubmodule("mac"));
+            if (gatewayMac != nullptr) {
+                EV_DETAIL << "Found gateway: " << gatewayMac << " at " << position << endl;
+                gateways.push_back(gatewayMac);
+                gatewayPositions.push_back(position);
+            }
+        }
+        cModule *nicMod = mod->getSubmodule("LoRaNic");
+        if (nicMod != nullptr) {
+            LoRaTDMAMac *nodeMac = dynamic_cast<LoRaTDMAMac *>(nicMod->getSubmodule("mac"));
+            if (nodeMac != nullptr)
+                nodes.push_back({nodeMac, position});
+        }
+    }
+    if (gateways.empty())
+        throw cRuntimeError("No TDMA gateways found");
+
+    // The cells share the grid, so they must agree on its shape
+    for (auto gatewayMac : gateways) {
+        if (gatewayMac->numberOfChannels != gateways[0]->numberOfChannels
+                || gatewayMac->txslotDuration != gateways[0]->txslotDuration
+                || gatewayMac->rxslotDuration != gateways[0]->rxslotDuration
+                || gatewayMac->variableSlotLength != gateways[0]->variableSlotLength
+                || gatewayMac->enforceDutyCycle != gateways[0]->enforceDutyCycle
+                || gatewayMac->broadcastGuard != gateways[0]->broadcastGuard
+                || gatewayMac->slotResolution != gateways[0]->slotResolution)
+            throw cRuntimeError("Gateway %s does not use the same channels and slot durations as %s", gatewayMac->getFullPath().c_str(), gateways[0]->getFullPath().c_str());
+    }
+
+    clients.assign(gateways.size(), {});
+    for (auto& node : nodes) {
+        size_t home = 0;
+        std::vector<bool> inRange(gateways.size());
+        for (size_t g = 0; g < gateways.size(); g++) {
+            double distance = node.second.distance(gatewayPositions[g]);
+            inRange[g] = m(distance) < reuseDistance;
+            if (distance < node.second.distance(gatewayPositions[home]))
+                home = g;
+        }
+        MacAddress nodeAddress = node.first->getAddress();
+        clients[home].push_back(nodeAddress);
+        interferes[nodeAddress] = inRange;
+        node.first->setHomeGateway(gateways[home]->getAddress(), SIMTIME_AS_CLOCKTIME(gateways[home]->txslotDuration * home));
+        EV_DETAIL << "Node " << nodeAddress << " belongs to gateway " << home << endl;
+    }
+}
+
+bool LoRaTDMAClusterScheduler::isConflict(const MacAddress& clientA, int gatewayA, const MacAddress& clientB, int gatewayB) const
+{
+    // Nodes of the same cell never share a cell of the grid by accident, the gateway placed them
+    if (gatewayA == gatewayB)
+        return false;
+    return interferes.at(clientA)[gatewayB] || interferes.at(clientB)[gatewayA];
+}
+
+void LoRaTDMAClusterScheduler::createTimeslots(int gatewayIndex, long cycle)
+{
+    // The first gateway to send its beacon computes the cycle for all of them
+    if (cycle <= lastCycle)
+        return;
+    lastCycle = cycle;
+
+    // The uplink slots of all cells run in parallel, so the cycle is as long as the longest cell needs
+    int usedTimeSlots = 0;
+    for (auto gatewayMac : gateways)
+        usedTimeSlots = std::max(usedTimeSlots, gatewayMac->computeUsedTimeSlots());
+    for (auto gatewayMac : gateways) {
+        gatewayMac->usedTimeSlots = usedTimeSlots;
+        gatewayMac->createCellTimeslots();
+    }
+    resolveConflicts(cycle);
+
+    // The cells' time slots stay aligned, so each is as long as the longest transmission any cell puts in it
+    std::vector<simtime_t> slotAirtimes(usedTimeSlots, 0);
+    std::vector<double> slotDrifts(usedTimeSlots, 0);
+    for (auto gatewayMac : gateways)
+        gatewayMac->fitSlotAirtimes(slotAirtimes, slotDrifts);
+    for (auto gatewayMac : gateways)
+        gatewayMac->setSlotLengths(slotAirtimes, slotDrifts);
+
+    /* A gateway's cycle runs from its beacon to its next one, the same for all of them.
+     * The beacons are not made yet, so the last ones stand in for their airtime.
+     */
+    if (gateways[0]->enforceDutyCycle) {
+        simtime_t minCycleLength = 0;
+        for (auto gatewayMac : gateways)
+            minCycleLength = std::max(minCycleLength, gatewayMac->getMinCycleLength(gatewayMac->lastBeaconAirtime));
+        simtime_t cycleLength = gateways[0]->txslotDuration * gateways.size() + gateways[0]->uplinkLength + gateways[0]->broadcastGuard;
+        for (auto gatewayMac : gateways)
+            gatewayMac->stretchCycle(cycleLength, minCycleLength);
+    }
+}
+
+void LoRaTDMAClusterScheduler::resolveConflicts(long cycle)
+{
+    /* Go through the gateways in turn, starting with a different one every cycle so no
+     * cell always loses. An entry that conflicts with what the earlier gateways kept is
+     * moved to another time slot on the same channel that is free in its own cell and
+     * safe towards the others, or dropped when there is none.
+     */
+    int usedTimeSlots = gateways[0]->usedTimeSlots;
+    int numberOfChannels = gateways[0]->numberOfChannels;
+    std::vector<std::vector<std::pair<MacAddress, int>>> occupants(usedTimeSlots * numberOfChannels); // Kept entries per cell and their gateway
+
+    auto isSafe = [&] (const MacAddress& client, int gateway, int t, int c) {
+        for (auto& occupant : occupants[t * numberOfChannels + c])
+            if (isConflict(client, gateway, occupant.first, occupant.second))
+                return false;
+        return true;
+    };
+
+    for (size_t i = 0; i < gateways.size(); i++) {
+        int g = (i + cycle) % gateways.size();
+        std::vector<LoRaTDMATimeslot>& timeslots = *gateways[g]->timeslots;
+
+        // What this cell uses itself, a moved entry must not land on top of it
+        std::vector<bool> ownCell(usedTimeSlots * numberOfChannels, false);
+        std::map<MacAddress, std::vector<bool>> busy;
+        for (auto& timeslot : timeslots) {
+            ownCell[timeslot.timeslot * numberOfChannels + timeslot.channel] = true;
+            busy[timeslot.address].resize(usedTimeSlots, false);
+            busy[timeslot.address][timeslot.timeslot] = true;
+        }
+
+        std::vector<LoRaTDMATimeslot> kept;
+        for (auto& timeslot : timeslots) {
+            int c = timeslot.channel;
+            if (!isSafe(timeslot.address, g, timeslot.timeslot, c)) {
+                int t = 0;
+                while (t < usedTimeSlots && (ownCell[t * numberOfChannels + c] || busy[timeslot.address][t] || !isSafe(timeslot.address, g, t, c)))
+                    t++;
+                busy[timeslot.address][timeslot.timeslot] = false;
+                if (t == usedTimeSlots) {
+                    EV_DETAIL << "Dropping slot " << timeslot.timeslot << " of " << timeslot.address << " on channel " << c << ", it collides with a neighbouring cell" << endl;
+                    numDropped++;
+                    continue;
+                }
+                EV_DETAIL << "Moving slot " << timeslot.timeslot << " of " << timeslot.address << " on channel " << c << " to " << t << endl;
+                ownCell[t * numberOfChannels + c] = true;
+                busy[timeslot.address][t] = true;
+                timeslot.timeslot = t;
+                numMoved++;
+            }
+            auto& cellOccupants = occupants[timeslot.timeslot * numberOfChannels + c];
+            if (std::any_of(cellOccupants.begin(), cellOccupants.end(), [&] (const std::pair<MacAddress, int>& occupant) { return occupant.second != g; }))
+                numReused++;
+            cellOccupants.push_back({timeslot.address, g});
+            kept.push_back(timeslot);
+        }
+
+        // Keep the order the beacon expects: slot by slot with SF layers, otherwise channel by channel
+        std::stable_sort(kept.begin(), kept.end(), [&] (const LoRaTDMATimeslot& a, const LoRaTDMATimeslot& b) {
+            if (gateways[g]->spreadFactorLayers > 1)
+                return a.timeslot < b.timeslot || (a.timeslot == b.timeslot && a.channel < b.channel);
+            return a.channel < b.channel || (a.channel == b.channel && a.timeslot < b.timeslot);
+        });
+        timeslots = kept;
+    }
+}
+
+}
@@ -0,0 +1,78 @@
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+// 
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see http://www.gnu.org/licenses/.
+// 
+
+
+#ifndef LORA_LORATDMACLUSTERSCHEDULER_H_
+#define LORA_LORATDMACLUSTERSCHEDULER_H_
+
+#include "inet/common/INETDefs.h"
+#include "inet/common/geometry/common/Coord.h"
+#include "inet/linklayer/common/MacAddress.h"
+#include <vector>
+#include <map>
+
+#include "LoRaTDMAGWMac.h"
+
+namespace flora_tdma {
+
+using namespace inet;
+
+/**
+ * Schedules the uplinks of several TDMA gateways together.
+ *
+ * Every node belongs to its nearest gateway. The gateways take turns to send
+ * their beacon at the start of a cycle, after which the uplink slots of all
+ * cells run in parallel. A cell of the time x frequency grid may be used by
+ * several gateways at once, as long as none of the nodes in it is within the
+ * reuse distance of another of those gateways.
+ */
+class LoRaTDMAClusterScheduler : public cSimpleModule
+{
+  protected:
+    double reuseDistanceFactor;
+    m reuseDistance = m(NaN);
+
+    std::vector<LoRaTDMAGWMac *> gateways; // The index is the turn in the beacon period
+    std::vector<std::vector<MacAddress>> clients; // Per gateway, in registration order
+    std::map<MacAddress, std::vector<bool>> interferes; // Per node, the gateways it is within the reuse distance of
+    bool discovered = false;
+    long lastCycle = 0;
+
+    /** @name Statistics */
+    //@{
+    long numReused; // Entries sharing a cell with another gateway's entry
+    long numMoved;
+    long numDropped;
+    //@}
+
+  protected:
+    virtual void initialize() override;
+    virtual void finish() override;
+    virtual void handleMessage(cMessage *msg) override;
+
+    virtual void discoverNetwork(const IRadio *gatewayRadio);
+    virtual bool isConflict(const MacAddress& clientA, int gatewayA, const MacAddress& clientB, int gatewayB) const;
+    virtual void resolveConflicts(long cycle);
+
+  public:
+    virtual int registerGateway(LoRaTDMAGWMac *gatewayMac);
+    virtual int getNumberOfGateways() const { return gateways.size(); }
+    virtual const std::vector<MacAddress>& getClients(int gatewayIndex) const { return clients[gatewayIndex]; }
+    virtual void createTimeslots(int gatewayIndex, long cycle);
+};
+
+}
+
+#endif /* LORA_LORATDMACLUSTERSCHEDULER_H_ */
@@ -0,0 +1,51 @@
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+// 
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see http://www.gnu.org/licenses/.
+// 
+
+
+
+#ifndef LORA_LORATDMAGWFRAME_H_
+#define LORA_LORATDMAGWFRAME_H_
+
+#include "LoRaTDMAGWFrame_m.h"
+#include "LoRaTDMASchedule.h"
+
+namespace flora_tdma {
+
+/**
+ * The beacon. The schedule is not a field of the message but a shared, immutable
+ * LoRaTDMASchedule: copying the beacon for every node that receives it only copies
+ * the pointer. The chunk length still accounts for the encoded schedule.
+ */
+class LoRaTDMAGWFrame : public LoRaTDMAGWFrame_Base
+{
+  protected:
+    LoRaTDMASchedulePtr schedule; // nullptr until the gateway sets one, reads as an empty schedule
+
+  private:
+    void copy(const LoRaTDMAGWFrame& other) { schedule = other.schedule; }
+
+  public:
+    LoRaTDMAGWFrame() : LoRaTDMAGWFrame_Base() {}
+    LoRaTDMAGWFrame(const LoRaTDMAGWFrame& other) : LoRaTDMAGWFrame_Base(other) { copy(other); }
+    LoRaTDMAGWFrame& operator=(const LoRaTDMAGWFrame& other) { if (this == &other) return *this; LoRaTDMAGWFrame_Base::operator=(other); copy(other); return *this; }
+    virtual LoRaTDMAGWFrame *dup() const override { return new LoRaTDMAGWFrame(*this); }
+
+    const LoRaTDMASchedule& getSchedule() const;
+    void setSchedule(LoRaTDMASchedulePtr schedule) { handleChange(); this->schedule = schedule; }
+};
+
+}
+
+#endif /* LORA_LORATDMAGWFRAME_H_ */
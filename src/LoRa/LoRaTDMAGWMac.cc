@@ -18,12 +18,31 @@
 #include "../LoRaPhy/LoRaPhyPreamble_m.h"
 #include "inet/common/ProtocolTag_m.h"
 #include "inet/physicallayer/wireless/common/contract/packetlevel/IRadio.h"
+#include "LoRaGWRadio.h"
+#include "LoRaTDMAClusterScheduler.h"
+#include "inet/physicallayer/wireless/common/contract/packetlevel/SignalTag_m.h"
+#include "../LoRaPhy/LoRaReceiver.h"
+#include "../LoRaPhy/LoRaAirtime.h"
+#include <algorithm>
+#include <map>
+#include <cmath>
+#include <list>
+#include <set>
 
 
 namespace flora_tdma {
 
 Define_Module(LoRaTDMAGWMac);
 
+LoRaTDMAGWMac::~LoRaTDMAGWMac()
+{
+    for (auto& nodeMailbox : mailbox)
+        for (auto packet : nodeMailbox.second)
+            delete packet;
+    for (auto packet : cycleBroadcasts)
+        delete packet;
+}
+
 void LoRaTDMAGWMac::initialize(int stage)
 {
     MacProtocolBase::initialize(stage);
@@ -34,18 +53,108 @@ void LoRaTDMAGWMac::initialize(int stage)
         radio = check_and_cast<IRadio *>(radioModule);
         const char *addressString = par("address");
         GW_forwardedDown = 0;
-        GW_droppedDC = 0;
         txslotDuration = par("txslotDuration");
         rxslotDuration = par("rxslotDuration");
         broadcastGuard = par("broadcastGuard");
         startTransmitOffset = par("startTransmitOffset");
         firstTXSlot = par("firstTXSlot");
+        adaptiveSuperframe = par("adaptiveSuperframe");
+        numberOfTimeSlots = par("numberOfTimeSlots");
+        minTimeSlots = par("minTimeSlots");
+        maxTimeSlots = par("maxTimeSlots");
+        if (minTimeSlots < 1 || maxTimeSlots < minTimeSlots || maxTimeSlots > MAX_TIME_SLOTS)
+            throw cRuntimeError("Invalid superframe bounds: minTimeSlots = %d, maxTimeSlots = %d", minTimeSlots, maxTimeSlots);
+        if (numberOfTimeSlots < 1 || numberOfTimeSlots > MAX_TIME_SLOTS)
+            throw cRuntimeError("Invalid numberOfTimeSlots = %d", numberOfTimeSlots);
+        slotsPerClient = 1;
+        receivedInCycle = 0;
+        usedTimeSlots = 0;
+
+        channelFrequencies = cStringTokenizer(par("channelFrequencies")).asDoubleVector();
+        numberOfChannels = channelFrequencies.size();
+        if (numberOfChannels < 1 || numberOfChannels > MAX_CHANNELS)
+            throw cRuntimeError("Invalid number of channels in channelFrequencies: %d", numberOfChannels);
+
+        spreadFactorLayers = par("spreadFactorLayers");
+        if (spreadFactorLayers < 1 || spreadFactorLayers > 6)
+            throw cRuntimeError("Invalid spreadFactorLayers = %d, there are only SF7 to SF12", spreadFactorLayers);
+        linkMargin = par("linkMargin");
+        captureMargin = par("captureMargin");
+
+        const char *slotAllocationString = par("slotAllocation");
+        if (!strcmp(slotAllocationString, "roundRobin"))
+            slotAllocation = ROUND_ROBIN;
+        else if (!strcmp(slotAllocationString, "demand"))
+            slotAllocation = DEMAND;
+        else
+            throw cRuntimeError("Unknown slotAllocation: %s", slotAllocationString);
+        keepAliveSlot = par("keepAliveSlot");
+        keepAliveShare = par("keepAliveShare");
+        if (keepAliveShare < 0 || keepAliveShare > 1)
+            throw cRuntimeError("Invalid keepAliveShare = %g", keepAliveShare);
+        // The adaptive cycle is sized to the demand, so a node without backlog would never get a slot again
+        if (adaptiveSuperframe && slotAllocation == DEMAND && !keepAliveSlot)
+            throw cRuntimeError("keepAliveSlot cannot be turned off with adaptiveSuperframe and slotAllocation = \"demand\"");
+
+        const char *beaconEncodingString = par("beaconEncoding");
+        if (!strcmp(beaconEncodingString, "full"))
+            beaconEncoding = FULL;
+        else if (!strcmp(beaconEncodingString, "shortId"))
+            beaconEncoding = SHORT_ID;
+        else if (!strcmp(beaconEncodingString, "runLength"))
+            beaconEncoding = RUN_LENGTH;
+        else if (!strcmp(beaconEncodingString, "bitmap"))
+            beaconEncoding = BITMAP;
+        else if (!strcmp(beaconEncodingString, "auto"))
+            beaconEncoding = AUTO;
+        else
+            throw cRuntimeError("Unknown beaconEncoding: %s", beaconEncodingString);
+
+        variableSlotLength = par("variableSlotLength");
+        clockDrift = par("clockDrift");
+        slotResolution = par("slotResolution");
+        if (clockDrift < 0 || slotResolution <= 0)
+            throw cRuntimeError("Invalid slot length parameters: clockDrift = %g, slotResolution = %s", clockDrift, slotResolution.str().c_str());
+        uplinkLength = 0;
+
+        acknowledgeUplinks = par("acknowledgeUplinks");
+
+        maxDownlinkBytes = B(par("maxDownlinkBytes"));
+        mailboxSize = par("mailboxSize");
+        numDownlinks = 0;
+        numDownlinksDropped = 0;
+
+        enforceDutyCycle = par("enforceDutyCycle");
+        lastBeaconAirtime = txslotDuration - startTransmitOffset; // Until we know better, the longest a beacon may be
+
+        clientsPerPage = par("clientsPerPage");
+        if (clientsPerPage < 0)
+            throw cRuntimeError("Invalid clientsPerPage: %d", clientsPerPage);
+        if (clientsPerPage > 0 && enforceDutyCycle)
+            throw cRuntimeError("clientsPerPage cannot be combined with enforceDutyCycle, the cycle is stretched per beacon");
+
+        overTheAirJoin = par("overTheAirJoin");
+        joinWindow = overTheAirJoin ? par("joinWindow").doubleValue() : 0;
+        maxJoinsPerCycle = par("maxJoinsPerCycle");
+        if (overTheAirJoin && (joinWindow <= 0 || maxJoinsPerCycle < 1))
+            throw cRuntimeError("Invalid join parameters: joinWindow = %s, maxJoinsPerCycle = %d", joinWindow.str().c_str(), maxJoinsPerCycle);
+        numJoinRequests = 0;
+        lastJoinTime = 0;
+
+        cycle = 0;
+        totalTimeSlots = 0;
+        totalReceived = 0;
+        numUnplacedSlots = 0;
+        numBeacons = 0;
+        totalBeaconAirtime = 0;
+        WATCH(usedTimeSlots);
+        WATCH(totalReceived);
 
         startTXSlot = new cMessage("startTXSlot");
         endTXSlot = new cMessage("endTXSlot");
         startTransmit = new cMessage("startTransmit");
 
-        timeslots = new std::vector<MacAddress>(100);
+        timeslots = new std::vector<LoRaTDMATimeslot>();
 
         if (!strcmp(addressString, "auto")) {
             // assign automatic address
@@ -65,32 +174,54 @@ void LoRaTDMAGWMac::initialize(int stage)
         handleState(nullptr);
     }
     else if (stage == INITSTAGE_LINK_LAYER) {
-        // This should populate the client array with macadresses
-        size_t i = 0;
-        cModule *network = cSimulation::getActiveSimulation()->getSystemModule();
-        for (SubmoduleIterator it(network); !it.end(); ++it) {
-            cModule *mod = *it;
-            EV_DETAIL << "Searching in " << mod << endl;
-
-            cModule *nicMod = mod->getSubmodule("LoRaNic");
-            if (nicMod != nullptr) {
-                // It has a LoRaNic
-                EV_DETAIL << "Found nic: " << nicMod << endl;
-                cModule *macMod = nicMod->getSubmodule("mac");
-                if (macMod != nullptr) {
-                    // Found a mac module
-                    EV_DETAIL << "Found mac: " << macMod << endl;
-                    LoRaTDMAMac *nodeMac = dynamic_cast<LoRaTDMAMac *>(macMod);
-                    MacAddress nodeAddress = nodeMac->getAddress();
-                    EV_DETAIL << "Node address: " << nodeAddress << endl;
-                    clients[i++] = nodeAddress;
+        if (strcmp(par("clusterSchedulerModule"), "")) {
+            if (overTheAirJoin)
+                throw cRuntimeError("overTheAirJoin cannot be combined with a cluster scheduler, it assigns the nodes to the gateways");
+            if (clientsPerPage > 0)
+                throw cRuntimeError("clientsPerPage cannot be combined with a cluster scheduler, the gateways already take turns in the beacon period");
+            // Several gateways: the cluster scheduler decides who belongs to us and when we send the beacon
+            clusterScheduler = getModuleFromPar<LoRaTDMAClusterScheduler>(par("clusterSchedulerModule"), this);
+            gatewayIndex = clusterScheduler->registerGateway(this);
+            numberOfGateways = clusterScheduler->getNumberOfGateways();
+            for (auto& clientAddress : clusterScheduler->getClients(gatewayIndex))
+                addClient(clientAddress);
+
+            // Our beacon goes out in our own part of the beacon period
+            simtime_t beaconPhaseOffset = txslotDuration * gatewayIndex;
+            cancelEvent(startTXSlot);
+            cancelEvent(endTXSlot);
+            cancelEvent(startTransmit);
+            scheduleAt(firstTXSlot + beaconPhaseOffset, startTXSlot);
+            scheduleAt(firstTXSlot + beaconPhaseOffset + txslotDuration, endTXSlot);
+            scheduleAt(firstTXSlot + beaconPhaseOffset + startTransmitOffset, startTransmit);
+        }
+        else if (overTheAirJoin) {
+            EV << "Waiting for join requests" << endl;
+        }
+        else {
+            // This should populate the client array with macadresses
+            cModule *network = cSimulation::getActiveSimulation()->getSystemModule();
+            for (SubmoduleIterator it(network); !it.end(); ++it) {
+                cModule *mod = *it;
+                EV_DETAIL << "Searching in " << mod << endl;
+
+                cModule *nicMod = mod->getSubmodule("LoRaNic");
+                if (nicMod != nullptr) {
+                    // It has a LoRaNic
+                    EV_DETAIL << "Found nic: " << nicMod << endl;
+                    cModule *macMod = nicMod->getSubmodule("mac");
+                    if (macMod != nullptr) {
+                        // Found a mac module
+                        EV_DETAIL << "Found mac: " << macMod << endl;
+                        LoRaTDMAMac *nodeMac = dynamic_cast<LoRaTDMAMac *>(macMod);
+                        MacAddress nodeAddress = nodeMac->getAddress();
+                        EV_DETAIL << "Node address: " << nodeAddress << endl;
+                        addClient(nodeAddress);
+                    }
                 }
             }
-            // if (i > MAX_MAC_ADDR_GW_FRAME) {
-            //     throw cRuntimeError("Too many clients");
-            // }
         }
-        numberOfNodes = i;
+        numberOfNodes = clients.size();
         EV << "Number of nodes in this simulation is: " << numberOfNodes << endl;
         radio->setRadioMode(IRadio::RADIO_MODE_RECEIVER);
         nextNodeInTimeSlotQueue = 0;
@@ -99,6 +230,21 @@ void LoRaTDMAGWMac::initialize(int stage)
 
 void LoRaTDMAGWMac::finish()
 {
+    recordScalar("totalTimeSlots", totalTimeSlots);
+    recordScalar("totalReceived", totalReceived);
+    recordScalar("slotUtilization", totalTimeSlots > 0 ? (double)totalReceived / totalTimeSlots : 0.0);
+    recordScalar("meanBeaconAirtime", numBeacons > 0 ? totalBeaconAirtime.dbl() / numBeacons : 0.0);
+    if (spreadFactorLayers > 1)
+        recordScalar("numUnplacedSlots", numUnplacedSlots);
+    if (maxDownlinkBytes > B(0)) {
+        recordScalar("numDownlinks", numDownlinks);
+        recordScalar("numDownlinksDropped", numDownlinksDropped);
+    }
+    if (overTheAirJoin) {
+        recordScalar("numJoinRequests", numJoinRequests);
+        recordScalar("numClients", numberOfNodes);
+        recordScalar("lastJoinTime", lastJoinTime);
+    }
 }
 
 
@@ -130,10 +276,66 @@ void LoRaTDMAGWMac::handleLowerMessage(cMessage *msg)
         // Make the message a packet and get the Preamble and macframe from it
         auto pkt = check_and_cast<Packet *>(msg);
         auto header = pkt->popAtFront<LoRaPhyPreamble>();
+        if (dynamicPtrCast<const LoRaTDMAGWFrame>(pkt->peekAtFront<Chunk>()) != nullptr) {
+            // A neighbouring gateway's beacon on a channel we share with it
+            EV << "Ignoring beacon of another gateway: " << pkt << endl;
+            delete msg;
+            return;
+        }
         const auto &frame = pkt->peekAtFront<LoRaTDMAMacFrame>();
         EV << "Received packet: " << pkt << endl;
         EV << "HEADER: " << header << endl;
         EV << "MAC FRAME: " << frame << endl;   
+        if (frame->getFrameType() == TDMA_JOIN_REQUEST) {
+            MacAddress nodeAddress = frame->getTransmitterAddress();
+            if (!overTheAirJoin)
+                EV_WARN << "Ignoring join request from " << nodeAddress << ", overTheAirJoin is off" << endl;
+            else if (pendingJoinAddresses.insert(nodeAddress.getInt()).second) {
+                EV << "Join request from " << nodeAddress << endl;
+                numJoinRequests++;
+                pendingJoins.push_back(nodeAddress);
+            }
+            delete msg;
+            return;
+        }
+        // Remember how much the node has left, this drives the demand allocation.
+        // With the cluster scheduler a reused channel also brings uplinks of other cells, they are not ours to count
+        int clientIndex = findClient(frame->getTransmitterAddress());
+        if (clientIndex >= 0) {
+            receivedInCycle++;
+            totalReceived++;
+            LoRaTDMAClient& client = clients[clientIndex];
+            client.backlog = frame->getBacklog();
+            client.driftClass = std::min((int)frame->getDriftClass(), DRIFT_CLASSES - 1);
+            int payloadBytes = (pkt->getDataLength().get() + 7) / 8; // Without the preamble, as the transmitter counts it
+            // A slot sized to the last uplink would cut off the next longer one, so we keep the largest
+            client.maxPayloadBytes = std::max(client.maxPayloadBytes, payloadBytes);
+            client.lastHeard = simTime();
+            if (!variableSlotLength) {
+                // Fixed slots have to hold the longest uplink, the length of the one we just got is known
+                simtime_t airtime = startTransmitOffset + LoRaAirtime::getAirtime(header->getSpreadFactor(), header->getBandwidth(), header->getCodeRendundance(), payloadBytes, header->getUseHeader());
+                if (airtime > rxslotDuration)
+                    EV_WARN << "Uplink of " << frame->getTransmitterAddress() << " takes " << airtime << "s, longer than the time slot of " << rxslotDuration << "s" << endl;
+            }
+            if (acknowledgeUplinks) {
+                auto signalTimeInd = pkt->findTag<SignalTimeInd>();
+                int entry = findTimeslotEntry(clientIndex, signalTimeInd != nullptr ? signalTimeInd->getStartTime() : simTime());
+                if (entry >= 0)
+                    uplinkReceived[entry] = true;
+                else
+                    EV_WARN << "Uplink of " << frame->getTransmitterAddress() << " is outside its time slots, not acknowledging it" << endl;
+            }
+            EV_DETAIL << "Node " << frame->getTransmitterAddress() << " reports backlog: " << (int)frame->getBacklog() << endl;
+
+            // The link budget decides which SF the node can use and who it can share a slot with
+            auto signalPowerInd = pkt->findTag<SignalPowerInd>();
+            if (signalPowerInd != nullptr) {
+                double rssi = math::mW2dBmW(mW(signalPowerInd->getPower()).get());
+                client.rssi = std::isnan(client.rssi) ? rssi : 0.5 * client.rssi + 0.5 * rssi;
+                client.spreadFactor = getLowestSpreadFactor(client.rssi);
+                EV_DETAIL << "Node " << frame->getTransmitterAddress() << " RSSI: " << rssi << " dBm, smoothed: " << client.rssi << " dBm" << endl;
+            }
+        }
     } else {
         EV << "Got message from lower layer: " << msg << ". But not in RECEIVE, discarding" << endl;
         EV_DEBUG << "macState: " << macState << endl;
@@ -142,32 +344,824 @@ void LoRaTDMAGWMac::handleLowerMessage(cMessage *msg)
     
 }
 
+void LoRaTDMAGWMac::handleUpperPacket(Packet *packet)
+{
+    /* Downlinks are not sent on their own, they wait in the mailbox of their node
+     * and go out with the next beacons. The node is taken from the MacAddressReq.
+     */
+    auto macAddressReq = packet->findTag<MacAddressReq>();
+    if (maxDownlinkBytes == B(0) || macAddressReq == nullptr) {
+        EV_WARN << "Dropping downlink " << packet << (maxDownlinkBytes == B(0) ? ", there is no mailbox" : ", it has no destination") << endl;
+        numDownlinksDropped++;
+        delete packet;
+        return;
+    }
+    MacAddress nodeAddress = macAddressReq->getDestAddress();
+    if (dynamicPtrCast<const LoRaTDMAMacFrame>(packet->peekAtFront<Chunk>()) != nullptr)
+        packet->popAtFront<LoRaTDMAMacFrame>(); // The node only gets the payload, the beacon says who it is for
+    if (packet->getDataLength() > maxDownlinkBytes) {
+        EV_WARN << "Dropping downlink for " << nodeAddress << ", " << packet->getDataLength() << " does not fit in a beacon" << endl;
+        numDownlinksDropped++;
+        delete packet;
+        return;
+    }
+    std::deque<Packet *>& nodeMailbox = mailbox[nodeAddress];
+    if ((int)nodeMailbox.size() >= mailboxSize) {
+        EV_WARN << "Mailbox of " << nodeAddress << " is full, dropping downlink " << packet << endl;
+        numDownlinksDropped++;
+        delete packet;
+        return;
+    }
+    EV << "Downlink for " << nodeAddress << " waits for the next beacon: " << packet << endl;
+    nodeMailbox.push_back(packet);
+}
+
+B LoRaTDMAGWMac::collectDownlinks(std::vector<LoRaTDMADownlink>& downlinks, std::vector<Packet *>& payloads, int page, B budget)
+{
+    // One downlink per node and round, starting after the node served first last time, until the beacon is full.
+    // A page only carries the downlinks of its own clients, the ones for everybody are handed out per cycle
+    B length = B(0);
+    bool first = true;
+    bool added = true;
+    while (added) {
+        added = false;
+        auto it = mailbox.upper_bound(lastMailboxServed);
+        for (size_t n = 0; n < mailbox.size(); n++, it++) {
+            if (it == mailbox.end())
+                it = mailbox.begin();
+            if (it->second.empty() || length + it->second.front()->getDataLength() > budget)
+                continue;
+            if (page >= 0 && (it->first.isBroadcast() || getPage(findClient(it->first)) != page))
+                continue;
+            Packet *payload = it->second.front();
+            it->second.pop_front();
+            LoRaTDMADownlink downlink;
+            downlink.address = it->first;
+            downlink.length = payload->getDataLength();
+            if (first)
+                lastMailboxServed = it->first;
+            first = false;
+            downlinks.push_back(downlink);
+            payloads.push_back(payload);
+            length += downlink.length;
+            added = true;
+        }
+    }
+    for (auto it = mailbox.begin(); it != mailbox.end(); ) {
+        if (it->second.empty())
+            it = mailbox.erase(it);
+        else
+            it++;
+    }
+    numDownlinks += payloads.size();
+    return length;
+}
+
+int LoRaTDMAGWMac::findClient(const MacAddress& clientAddress) const
+{
+    return clients.find(clientAddress);
+}
+
+int LoRaTDMAGWMac::addClient(const MacAddress& clientAddress)
+{
+    // The registration order is the short ID
+    int clientIndex = clients.add(clientAddress);
+    numberOfNodes = clients.size();
+    return clientIndex;
+}
+
+void LoRaTDMAGWMac::admitPendingJoins(std::vector<MacAddress>& accepted)
+{
+    /* Only so many accepts fit in a beacon, the rest waits for the next cycle.
+     * A node we already know lost our accept and asked again, so it gets another.
+     */
+    while (!pendingJoins.empty() && (int)accepted.size() < maxJoinsPerCycle) {
+        MacAddress clientAddress = pendingJoins.front();
+        pendingJoins.pop_front();
+        pendingJoinAddresses.erase(clientAddress.getInt());
+        if (findClient(clientAddress) < 0) {
+            addClient(clientAddress);
+            lastJoinTime = simTime();
+            EV << "Admitted " << clientAddress << " as client " << numberOfNodes - 1 << endl;
+        }
+        accepted.push_back(clientAddress);
+    }
+    if (!pendingJoins.empty())
+        EV_DETAIL << pendingJoins.size() << " join request(s) wait for the next beacon" << endl;
+}
+
+int LoRaTDMAGWMac::getDemand(size_t clientIndex) const
+{
+    // Nodes we never heard from are assumed to have a frame waiting
+    int backlog = clients[clientIndex].backlog;
+    return backlog < 0 ? 1 : backlog;
+}
+
+int LoRaTDMAGWMac::computeUsedTimeSlots()
+{
+    // Before anybody joined the cycle is only the beacon and the join window, the next beacon can then admit the requesters
+    if (numberOfNodes == 0) {
+        receivedInCycle = 0;
+        return 0;
+    }
+    if (!adaptiveSuperframe)
+        return numberOfTimeSlots;
+
+    if (slotAllocation == DEMAND) {
+        /* The reported backlog tells us exactly how many slots the next cycle needs.
+         * They are spread over the channels, but a node can only use one channel at a time.
+         */
+        int demandedSlots = 0;
+        int largestDemand = 0;
+        for (int i = 0; i < numberOfNodes; i++) {
+            int demand = getDemand(i);
+            demandedSlots += demand > 0 ? demand : (keepAliveSlot ? 1 : 0);
+            largestDemand = std::max(largestDemand, demand);
+        }
+        receivedInCycle = 0;
+        int demandedTimeSlots = std::max((demandedSlots + getCellsPerTimeSlot() - 1) / getCellsPerTimeSlot(), largestDemand);
+        return std::min(std::max(demandedTimeSlots, minTimeSlots), maxTimeSlots);
+    }
+
+    /* Adapt the number of slots each client gets to the traffic of the last cycle.
+     * A saturated cycle means the nodes had more to send than they had slots for,
+     * so we spread the broadcast over more slots. A mostly idle cycle is shrunk
+     * again to cut the uplink latency and the idle airtime.
+     */
+    if (!timeslots->empty()) {
+        double utilization = (double)receivedInCycle / timeslots->size();
+        EV_DETAIL << "Last cycle utilization: " << utilization << " (" << receivedInCycle << "/" << timeslots->size() << ")" << endl;
+        if (utilization >= 0.9 && numberOfNodes * slotsPerClient < maxTimeSlots * getCellsPerTimeSlot())
+            slotsPerClient++;
+        else if (utilization < 0.5 && slotsPerClient > 1)
+            slotsPerClient--;
+    }
+    receivedInCycle = 0;
+
+    int neededTimeSlots = (numberOfNodes * slotsPerClient + getCellsPerTimeSlot() - 1) / getCellsPerTimeSlot();
+    return std::min(std::max(neededTimeSlots, minTimeSlots), maxTimeSlots);
+}
+
 void LoRaTDMAGWMac::createTimeslots() {
+    cycle++;
+    if (clusterScheduler != nullptr) {
+        // The cluster decides the cycle length and the slots of every cell together
+        clusterScheduler->createTimeslots(gatewayIndex, cycle);
+    }
+    else {
+        usedTimeSlots = computeUsedTimeSlots();
+        createCellTimeslots();
+        std::vector<simtime_t> slotAirtimes(usedTimeSlots, 0);
+        std::vector<double> slotDrifts(usedTimeSlots, 0);
+        fitSlotAirtimes(slotAirtimes, slotDrifts);
+        setSlotLengths(slotAirtimes, slotDrifts);
+    }
+    totalTimeSlots += timeslots->size();
+
+    // Only what made it into the grid is taken off the reported backlog
+    if (slotAllocation == DEMAND) {
+        for (auto& timeslot : *timeslots) {
+            int clientIndex = findClient(timeslot.address);
+            if (clients[clientIndex].backlog > 0)
+                clients[clientIndex].backlog--;
+        }
+    }
+
+    EV_DETAIL << "Generated timeslots" << endl;
+    std::vector<LoRaTDMATimeslot>& vecRef = *timeslots;
+    for (size_t i = 0; i < timeslots->size(); i++)
+    {
+        EV_DEBUG << "timeslot[" << vecRef[i].timeslot << "] on channel " << (int)vecRef[i].channel << " SF" << (int)vecRef[i].spreadFactor << " = " << vecRef[i].address << endl;
+    }
+    
+    ASSERT(timeslots->size() <= (size_t)(usedTimeSlots * getCellsPerTimeSlot()));
+}
+
+void LoRaTDMAGWMac::createCellTimeslots()
+{
     // Make sure that the timeslots are empty
     timeslots->clear();
+    EV << "Timeslots in this cycle: " << usedTimeSlots << " on " << numberOfChannels << " channel(s)" << endl;
+
+    if (numberOfNodes == 0) {
+        EV_WARN << "No clients to give timeslots" << endl;
+        return;
+    }
+
+    // The allocators decide who gets how many cells of the grid, placing them is the same for both
+    std::vector<int> sequence;
+    if (slotAllocation == DEMAND)
+        createDemandTimeslots(sequence);
+    else
+        createRoundRobinTimeslots(sequence);
+    if (variableSlotLength)
+        orderByDrift(sequence);
+    if (spreadFactorLayers > 1)
+        placeLayeredTimeslots(sequence);
+    else
+        placeTimeslots(sequence);
+}
+
+double LoRaTDMAGWMac::getClientDrift(size_t clientIndex) const
+{
+    // Nodes that compensate their drift well report a low class, the others may be off by the full clockDrift
+    int driftClass = clients[clientIndex].driftClass;
+    return driftClass < DRIFT_CLASSES - 1 ? std::min(DRIFT_CLASS_PPM[driftClass], clockDrift) : clockDrift;
+}
+
+void LoRaTDMAGWMac::orderByDrift(std::vector<int>& sequence) const
+{
+    // The timing error grows with the time since the beacon, so the worst clocks go first where it is still small
+    std::stable_sort(sequence.begin(), sequence.end(), [this] (int a, int b) {
+        return getClientDrift(a) > getClientDrift(b);
+    });
+}
+
+void LoRaTDMAGWMac::fitSlotAirtimes(std::vector<simtime_t>& slotAirtimes, std::vector<double>& slotDrifts) const
+{
+    // Raise every time slot to the longest transmission and the worst clock we put in it
+    for (auto& timeslot : *timeslots) {
+        int clientIndex = findClient(timeslot.address);
+        int payloadBytes = clients[clientIndex].maxPayloadBytes;
+        slotDrifts[timeslot.timeslot] = std::max(slotDrifts[timeslot.timeslot], getClientDrift(clientIndex));
+        simtime_t airtime = rxslotDuration; // Never heard, so we have to assume the worst case
+        if (variableSlotLength && payloadBytes >= 0)
+            airtime = startTransmitOffset + LoRaAirtime::getAirtime(timeslot.spreadFactor, Hz(125000), 4, payloadBytes);
+        slotAirtimes[timeslot.timeslot] = std::max(slotAirtimes[timeslot.timeslot], airtime);
+    }
+}
+
+void LoRaTDMAGWMac::setSlotLengths(const std::vector<simtime_t>& slotAirtimes, const std::vector<double>& slotDrifts)
+{
+    slotLengths.assign(usedTimeSlots, rxslotDuration);
+    uplinkLength = rxslotDuration * usedTimeSlots;
+    if (!variableSlotLength)
+        return;
+
+    /* A node starts its slot by its own clock, which has drifted from ours since the beacon.
+     * Later slots therefore need a wider guard on both sides. The uplinks start at most
+     * the other gateways' beacons (or beacon pages) and the join window after the beacon.
+     */
+    simtime_t slotStart = 0;
+    for (int t = 0; t < usedTimeSlots; t++) {
+        simtime_t length = 0;
+        if (slotAirtimes[t] > 0) {
+            simtime_t syncAge = txslotDuration * numberOfGateways * numberOfPages + joinWindow + slotStart + slotAirtimes[t];
+            length = slotAirtimes[t] + 2 * slotDrifts[t] * 1e-6 * syncAge;
+            length = slotResolution * ceil(length / slotResolution);
+            length = std::min(length, rxslotDuration);
+        }
+        slotLengths[t] = length;
+        slotStart += length;
+    }
+    uplinkLength = slotStart;
+    EV_DETAIL << "Variable slot lengths make the uplinks " << uplinkLength << "s instead of " << rxslotDuration * usedTimeSlots << "s" << endl;
+}
+
+int LoRaTDMAGWMac::findTimeslotEntry(int clientIndex, simtime_t receptionStart) const
+{
+    // A node never has two cells in one time slot, so the slot its uplink started in tells the entry
+    int entry = -1;
+    simtime_t latestStart = -1;
+    if (clientIndex >= (int)clientEntries.size())
+        return entry; // Admitted after the last beacon, so it has no slots yet
+    for (int i : clientEntries[clientIndex]) {
+        simtime_t slotStart = uplinkStart + broadcastGuard + slotStarts[(*timeslots)[i].timeslot];
+        if (slotStart <= receptionStart && slotStart > latestStart) {
+            entry = i;
+            latestStart = slotStart;
+        }
+    }
+    return entry;
+}
+
+simtime_t LoRaTDMAGWMac::getMinCycleLength(simtime_t beaconAirtime) const
+{
+    // Our beacon may only be on air dutyCycle of the time on its sub-band
+    Hz beaconFrequency = check_and_cast<LoRaGWRadio *>(radio)->beaconFrequency;
+    simtime_t minCycleLength = beaconAirtime / LoRaDutyCycleLedger::getDutyCycle(beaconFrequency);
+
+    // And so may every node on the sub-band of its channels, giving it more slots than that is wasted
+    std::map<std::pair<int, int>, simtime_t> clientAirtime;
+    for (auto& timeslot : *timeslots) {
+        int clientIndex = findClient(timeslot.address);
+        if (clients[clientIndex].maxPayloadBytes < 0)
+            continue; // Not heard yet, it keeps to its budget itself
+        Hz frequency = MHz(channelFrequencies[timeslot.channel]);
+        simtime_t& airtime = clientAirtime[{clientIndex, LoRaDutyCycleLedger::getSubBand(frequency)}];
+        airtime += LoRaAirtime::getAirtime(timeslot.spreadFactor, Hz(125000), 4, clients[clientIndex].maxPayloadBytes);
+        minCycleLength = std::max(minCycleLength, airtime / LoRaDutyCycleLedger::getDutyCycle(frequency));
+    }
+    return minCycleLength;
+}
+
+void LoRaTDMAGWMac::stretchCycle(simtime_t cycleLength, simtime_t minCycleLength)
+{
+    // The slots stay where they are, the cycle just idles at the end
+    if (cycleLength >= minCycleLength)
+        return;
+    simtime_t idle = slotResolution * ceil((minCycleLength - cycleLength) / slotResolution);
+    EV_DETAIL << "Stretching the cycle by " << idle << "s to keep to the duty cycle" << endl;
+    uplinkLength += idle;
+}
+
+void LoRaTDMAGWMac::createRoundRobinTimeslots(std::vector<int>& sequence)
+{
+    // Every cell of the grid, but never more than one per time slot for the same client
+    size_t cells = std::min(usedTimeSlots * getCellsPerTimeSlot(), usedTimeSlots * numberOfNodes);
 
-    // TODO: make this not a loop and something more intelligent
-    // Clients 300+ do not have timeslots. They should have, now define by MAX_MAC_ADDR_GW_FRAME
-    
     // Continue in a repeating order to fill the timeslots up for max utilization 
     size_t nodeIndex;
-    for (size_t i = 0; i < 100; i++) {
+    for (size_t i = 0; i < cells; i++) {
         nodeIndex = (i + nextNodeInTimeSlotQueue) % numberOfNodes;
-        timeslots->push_back(clients[nodeIndex]);
+        sequence.push_back(nodeIndex);
     }
 
     // Remember what lora node we got to and continue from there next time
     nextNodeInTimeSlotQueue = (nodeIndex+1);
-    EV << "Next node MAC to send is: " << clients[(nextNodeInTimeSlotQueue % numberOfNodes)] << endl;
+    EV << "Next node MAC to send is: " << clients[(nextNodeInTimeSlotQueue % numberOfNodes)].address << endl;
+}
 
-    EV_DETAIL << "Generated timeslots" << endl;
-    std::vector<MacAddress>& vecRef = *timeslots;
-    for (size_t i = 0; i < timeslots->size(); i++)
-    {
-        EV_DEBUG << "timeslot[" << i << "] = " << vecRef[i] << endl;
+void LoRaTDMAGWMac::createDemandTimeslots(std::vector<int>& sequence)
+{
+    std::vector<int> grants(numberOfNodes, 0);
+    std::vector<size_t> busyClients;
+    std::vector<size_t> idleClients;
+    int freeSlots = usedTimeSlots * getCellsPerTimeSlot();
+    long totalDemand = 0;
+
+    // A node has a single radio, so it can use at most one channel per time slot
+    auto getCappedDemand = [this] (size_t i) { return std::min(getDemand(i), usedTimeSlots); };
+
+    // We start from where we stopped last cycle, so the keep-alives rotate fairly
+    for (int n = 0; n < numberOfNodes; n++) {
+        size_t i = (n + nextNodeInTimeSlotQueue) % numberOfNodes;
+        int demand = getCappedDemand(i);
+        if (demand > 0) {
+            busyClients.push_back(i);
+            totalDemand += demand;
+        }
+        else if (keepAliveSlot)
+            idleClients.push_back(i);
+    }
+
+    /* Clients without backlog only get a keep-alive slot to report new data in.
+     * While others wait with a backlog the keep-alives only get keepAliveShare
+     * of the cycle, but at least one slot so none of them waits forever.
+     */
+    int keepAliveSlots = 0;
+    if (!idleClients.empty()) {
+        int reserved = totalDemand > 0 ? std::max(1, (int)(freeSlots * keepAliveShare)) : freeSlots;
+        keepAliveSlots = std::min({(int)idleClients.size(), reserved, freeSlots});
+        freeSlots -= keepAliveSlots;
+    }
+
+    // The rest is shared in proportion to the reported backlog (largest remainder method)
+    if (totalDemand <= freeSlots) {
+        for (auto i : busyClients)
+            grants[i] += getCappedDemand(i);
+        freeSlots -= totalDemand;
+    }
+    else {
+        std::vector<std::pair<double, size_t>> remainders;
+        int assigned = 0;
+        for (auto i : busyClients) {
+            double share = (double)getCappedDemand(i) * freeSlots / totalDemand;
+            int grant = (int)share;
+            grants[i] += grant;
+            assigned += grant;
+            remainders.push_back(std::make_pair(share - grant, i));
+        }
+        std::stable_sort(remainders.begin(), remainders.end(), [] (const std::pair<double, size_t>& a, const std::pair<double, size_t>& b) {
+            return a.first > b.first;
+        });
+        for (size_t k = 0; assigned < freeSlots; k++) {
+            grants[remainders[k].second]++;
+            assigned++;
+        }
+        freeSlots = 0;
+    }
+
+    // Whatever the demand left over also goes to keep-alives
+    int extraKeepAlives = std::min((int)idleClients.size() - keepAliveSlots, freeSlots);
+    keepAliveSlots += extraKeepAlives;
+    freeSlots -= extraKeepAlives;
+    for (int k = 0; k < keepAliveSlots; k++)
+        grants[idleClients[k]] = 1;
+    size_t firstSkipped = (size_t)keepAliveSlots < idleClients.size() ? idleClients[keepAliveSlots] : numberOfNodes;
+
+    // Slots nobody asked for (fixed cycle length) are handed out round-robin for new traffic
+    for (size_t n = 0; freeSlots > 0 && n < (size_t)(numberOfNodes * usedTimeSlots); n++) {
+        size_t i = (n + nextNodeInTimeSlotQueue) % numberOfNodes;
+        if (grants[i] < usedTimeSlots) {
+            grants[i]++;
+            freeSlots--;
+        }
+    }
+
+    // Every client gets its slots back to back
+    for (int n = 0; n < numberOfNodes; n++) {
+        size_t i = (n + nextNodeInTimeSlotQueue) % numberOfNodes;
+        for (int k = 0; k < grants[i]; k++)
+            sequence.push_back(i);
+    }
+
+    nextNodeInTimeSlotQueue = firstSkipped < (size_t)numberOfNodes ? firstSkipped : (nextNodeInTimeSlotQueue + 1) % numberOfNodes;
+}
+
+void LoRaTDMAGWMac::placeTimeslots(std::vector<int>& sequence)
+{
+    /* With more than one channel the cells of a client are put next to each other
+     * and then wrapped over the channels (McNaughton's rule). As long as nobody
+     * has more cells than there are time slots, a node is then never scheduled
+     * on two channels at the same time. With one channel the order is kept.
+     */
+    if (numberOfChannels > 1) {
+        std::vector<int> firstSeen(numberOfNodes, -1);
+        for (size_t k = 0; k < sequence.size(); k++) {
+            if (firstSeen[sequence[k]] < 0)
+                firstSeen[sequence[k]] = k;
+        }
+        std::stable_sort(sequence.begin(), sequence.end(), [&firstSeen] (int a, int b) {
+            return firstSeen[a] < firstSeen[b];
+        });
+    }
+
+    for (size_t k = 0; k < sequence.size(); k++) {
+        LoRaTDMATimeslot timeslot;
+        timeslot.address = clients[sequence[k]].address;
+        timeslot.timeslot = k % usedTimeSlots;
+        timeslot.channel = k / usedTimeSlots;
+        if (variableSlotLength)
+            timeslot.spreadFactor = getSpreadFactor(sequence[k]); // The slot is only as long as the node needs on its own SF
+        timeslots->push_back(timeslot);
     }
-    
-    ASSERT(timeslots->size() == 100);
+}
+
+void LoRaTDMAGWMac::placeLayeredTimeslots(std::vector<int>& sequence)
+{
+    /* Fill the grid slot by slot. A cell takes clients on different SFs as long as
+     * every pair of them survives the other according to nonOrthDelta, and a client
+     * is never in two cells of the same time slot. What does not fit has to wait for
+     * the next cycle: the demand allocator sees that from the backlog, round-robin
+     * starts the next cycle from the first client that lost a slot.
+     */
+    std::list<int> pending(sequence.begin(), sequence.end());
+    std::vector<int> lastTimeSlot(numberOfNodes, -1);
+    for (int t = 0; t < usedTimeSlots && !pending.empty(); t++) {
+        for (int c = 0; c < numberOfChannels && !pending.empty(); c++) {
+            std::vector<int> cell;
+            for (auto it = pending.begin(); it != pending.end() && (int)cell.size() < spreadFactorLayers; ) {
+                int client = *it;
+                bool fits = lastTimeSlot[client] != t;
+                for (auto other : cell)
+                    fits = fits && getSpreadFactor(client) != getSpreadFactor(other) && isCaptureSafe(client, other);
+                if (!fits) {
+                    ++it;
+                    continue;
+                }
+                cell.push_back(client);
+                lastTimeSlot[client] = t;
+                it = pending.erase(it);
+
+                LoRaTDMATimeslot timeslot;
+                timeslot.address = clients[client].address;
+                timeslot.timeslot = t;
+                timeslot.channel = c;
+                timeslot.spreadFactor = getSpreadFactor(client);
+                timeslots->push_back(timeslot);
+            }
+        }
+    }
+    if (!pending.empty()) {
+        numUnplacedSlots += pending.size();
+        EV_WARN << pending.size() << " slot(s) could not be placed without risking a collision, first of them for " << clients[pending.front()].address << endl;
+        if (slotAllocation == ROUND_ROBIN)
+            nextNodeInTimeSlotQueue = pending.front();
+    }
+}
+
+int LoRaTDMAGWMac::getSpreadFactor(size_t clientIndex) const
+{
+    // Without layers or variable slots there is nothing to gain from a lower SF
+    if (spreadFactorLayers == 1 && !variableSlotLength)
+        return 12;
+    return clients[clientIndex].spreadFactor;
+}
+
+int LoRaTDMAGWMac::getLowestSpreadFactor(double rssi) const
+{
+    // Before we heard the node, stay on the most robust SF
+    if (std::isnan(rssi))
+        return 12;
+    for (int spreadFactor = 7; spreadFactor < 12; spreadFactor++) {
+        // Our nodes always use 125 kHz
+        double sensitivity = math::mW2dBmW(mW(LoRaReceiver::getSensitivity(spreadFactor, kHz(125))).get());
+        if (rssi - linkMargin >= sensitivity)
+            return spreadFactor;
+    }
+    return 12;
+}
+
+bool LoRaTDMAGWMac::isCaptureSafe(size_t clientA, size_t clientB) const
+{
+    double rssiA = clients[clientA].rssi;
+    double rssiB = clients[clientB].rssi;
+    if (std::isnan(rssiA) || std::isnan(rssiB))
+        return false;
+    int spreadFactorA = getSpreadFactor(clientA);
+    int spreadFactorB = getSpreadFactor(clientB);
+    // Both have to survive the other, with some headroom for fading
+    return rssiA - rssiB - captureMargin >= LoRaReceiver::getNonOrthDelta(spreadFactorA, spreadFactorB)
+        && rssiB - rssiA - captureMargin >= LoRaReceiver::getNonOrthDelta(spreadFactorB, spreadFactorA);
+}
+
+/* Number of bits needed to write down any value from 0 to maxValue, at least one */
+static int bitsFor(int maxValue)
+{
+    int bits = 1;
+    while ((maxValue >> bits) > 0)
+        bits++;
+    return bits;
+}
+
+int LoRaTDMAGWMac::getShortIdBits(int numberOfIds) const
+{
+    return bitsFor(numberOfIds - 1);
+}
+
+/*
+ * Size of the schedule part of the beacon in the given encoding, or a negative
+ * length if the schedule cannot be written down that way.
+ * The short encodings start with 4 bits giving the width of their fields.
+ */
+b LoRaTDMAGWMac::getScheduleLength(BeaconEncoding encoding, const std::vector<int>& shortIds, int numberOfIds) const
+{
+    int idBits = getShortIdBits(numberOfIds);
+
+    // Split the schedule in runs of the same node
+    std::vector<std::pair<int, int>> runs; // short ID, number of slots
+    int longestRun = 1;
+    for (auto id : shortIds) {
+        if (!runs.empty() && runs.back().first == id)
+            longestRun = std::max(longestRun, ++runs.back().second);
+        else
+            runs.push_back(std::make_pair(id, 1));
+    }
+    int runBits = bitsFor(longestRun - 1); // A run is never empty, so we send its length minus one
+
+    switch (encoding) {
+    case FULL:
+        return b(48 * shortIds.size());
+
+    case SHORT_ID:
+        return b(4 + idBits * shortIds.size());
+
+    case RUN_LENGTH:
+        return b(4 + 4 + (idBits + runBits) * runs.size());
+
+    case BITMAP: {
+        /* Only works when every node has at most one run and the runs follow the
+         * short IDs in increasing order, wrapping around from the first one.
+         * Both of our allocators produce schedules like that as long as the
+         * cycle is not longer than one slot per node.
+         */
+        std::vector<bool> seen(numberOfIds, false);
+        int previousOffset = -1;
+        for (auto& run : runs) {
+            int offset = (run.first - runs.front().first + numberOfIds) % numberOfIds;
+            if (seen[run.first] || offset <= previousOffset)
+                return b(-1);
+            seen[run.first] = true;
+            previousOffset = offset;
+        }
+        return b(4 + idBits + numberOfIds + 4 + runBits * runs.size());
+    }
+
+    default:
+        throw cRuntimeError("Unknown beacon encoding: %d", encoding);
+    }
+}
+
+LoRaTDMAGWMac::BeaconEncoding LoRaTDMAGWMac::chooseBeaconEncoding(const std::vector<int>& shortIds, int numberOfIds, b& scheduleLength) const
+{
+    if (beaconEncoding != AUTO) {
+        scheduleLength = getScheduleLength(beaconEncoding, shortIds, numberOfIds);
+        if (scheduleLength >= b(0))
+            return beaconEncoding;
+        EV_WARN << "Schedule cannot be encoded as a bitmap, falling back to run-length" << endl;
+        scheduleLength = getScheduleLength(RUN_LENGTH, shortIds, numberOfIds);
+        return RUN_LENGTH;
+    }
+
+    BeaconEncoding best = FULL;
+    scheduleLength = getScheduleLength(FULL, shortIds, numberOfIds);
+    for (auto encoding : { SHORT_ID, RUN_LENGTH, BITMAP }) {
+        b length = getScheduleLength(encoding, shortIds, numberOfIds);
+        if (length >= b(0) && length < scheduleLength) {
+            best = encoding;
+            scheduleLength = length;
+        }
+    }
+    return best;
+}
+
+void LoRaTDMAGWMac::startCycle()
+{
+    // New clients are admitted before the schedule is made, so they get slots right away
+    cycleAccepts.clear();
+    if (overTheAirJoin)
+        admitPendingJoins(cycleAccepts);
+    numberOfPages = clientsPerPage > 0 ? std::max(1, (numberOfNodes + clientsPerPage - 1) / clientsPerPage) : 1;
+
+    // The acknowledgements are for the schedule of the last cycle, so they are taken before it is replaced. Every page acknowledges the entries it listed
+    if (acknowledgeUplinks) {
+        pageAcks.assign(numberOfPages, {});
+        for (size_t i = 0; i < uplinkReceived.size(); i++)
+            pageAcks[getPage(findClient((*timeslots)[i].address))].push_back(uplinkReceived[i]);
+    }
+    createTimeslots();
+    if (acknowledgeUplinks) {
+        // Index the schedule, an uplink is then matched to its entry without going through all of them
+        uplinkReceived.assign(timeslots->size(), false);
+        clientEntries.assign(numberOfNodes, {});
+        for (size_t i = 0; i < timeslots->size(); i++)
+            clientEntries[findClient((*timeslots)[i].address)].push_back(i);
+        slotStarts.assign(usedTimeSlots, 0);
+        for (int t = 1; t < usedTimeSlots; t++)
+            slotStarts[t] = slotStarts[t - 1] + slotLengths[t - 1];
+    }
+
+    // Downlinks for everybody go out with every page, so each node gets them from its own
+    cycleBroadcastLength = B(0);
+    auto broadcasts = mailbox.find(MacAddress::BROADCAST_ADDRESS);
+    if (numberOfPages > 1 && broadcasts != mailbox.end()) {
+        while (!broadcasts->second.empty() && cycleBroadcastLength + broadcasts->second.front()->getDataLength() <= maxDownlinkBytes) {
+            cycleBroadcasts.push_back(broadcasts->second.front());
+            cycleBroadcastLength += broadcasts->second.front()->getDataLength();
+            broadcasts->second.pop_front();
+        }
+        numDownlinks += cycleBroadcasts.size();
+    }
+
+    // The pages take turns like the gateways of a cluster, the uplinks start after the last one
+    if (numberOfPages > 1) {
+        uplinkStart = cycleStart + txslotDuration * numberOfPages + joinWindow;
+        EV << "Schedule of " << numberOfNodes << " clients split into " << numberOfPages << " beacon pages" << endl;
+    }
+}
+
+void LoRaTDMAGWMac::sendBeaconPage()
+{
+    Packet *pkt = new Packet("GatewayBroadcast");
+    IntrusivePtr<LoRaTDMAGWFrame> frame = makeShared<LoRaTDMAGWFrame>();
+    frame->setTransmitterAddress(address);
+    bool paged = numberOfPages > 1;
+    frame->setPageIndex(currentPage);
+    frame->setNumberOfPages(numberOfPages);
+
+    // A page only lists its own clients, their accepts and acknowledgements
+    std::vector<MacAddress> accepted;
+    for (auto& clientAddress : cycleAccepts) {
+        if (getPage(findClient(clientAddress)) == currentPage)
+            accepted.push_back(clientAddress);
+    }
+    if (overTheAirJoin) {
+        frame->setJoinWindow(SIMTIME_AS_CLOCKTIME(joinWindow));
+        frame->setJoinAcceptsArraySize(accepted.size());
+        for (size_t i = 0; i < accepted.size(); i++)
+            frame->setJoinAccepts(i, accepted[i]);
+    }
+    if (acknowledgeUplinks) {
+        std::vector<bool> noAcks;
+        const std::vector<bool>& acks = currentPage < (int)pageAcks.size() ? pageAcks[currentPage] : noAcks;
+        frame->setAckBitmapArraySize(acks.size());
+        for (size_t i = 0; i < acks.size(); i++)
+            frame->setAckBitmap(i, acks[i]);
+    }
+    frame->setUsedTimeSlots(usedTimeSlots);
+    if (variableSlotLength) {
+        simtime_t slotStart = 0;
+        frame->setSlotOffsetsArraySize(usedTimeSlots);
+        for (int t = 0; t < usedTimeSlots; t++) {
+            frame->setSlotOffsets(t, SIMTIME_AS_CLOCKTIME(slotStart));
+            slotStart += slotLengths[t];
+        }
+    }
+    frame->setNumberOfChannels(numberOfChannels);
+
+    // The mailbox goes out with the beacon, every downlink addressed by short ID (or all ones for everybody) and its length
+    std::vector<LoRaTDMADownlink> downlinks;
+    std::vector<Packet *> downlinkPayloads;
+    B downlinkLength = B(0);
+    if (maxDownlinkBytes > B(0)) {
+        for (auto payload : cycleBroadcasts) {
+            LoRaTDMADownlink downlink;
+            downlink.address = MacAddress::BROADCAST_ADDRESS;
+            downlink.length = payload->getDataLength();
+            downlinks.push_back(downlink);
+        }
+        downlinkLength = cycleBroadcastLength + collectDownlinks(downlinks, downlinkPayloads, paged ? currentPage : -1, maxDownlinkBytes - cycleBroadcastLength);
+        frame->setDownlinksArraySize(downlinks.size());
+        for (size_t i = 0; i < downlinks.size(); i++)
+            frame->setDownlinks(i, downlinks[i]);
+    }
+
+    // With pages the short IDs count from the first client of the page
+    std::vector<int> shortIds;
+    std::set<int> pageTimeSlots;
+    int firstId = paged ? currentPage * clientsPerPage : 0;
+    int numberOfIds = paged ? std::min(clientsPerPage, numberOfNodes - firstId) : numberOfNodes;
+    std::vector<LoRaTDMATimeslot> pageTimeslots;
+    for (auto& timeslot : *timeslots) {
+        int clientIndex = findClient(timeslot.address);
+        if (getPage(clientIndex) != currentPage)
+            continue;
+        pageTimeslots.push_back(timeslot);
+        shortIds.push_back(clientIndex - firstId);
+        pageTimeSlots.insert(timeslot.timeslot);
+    }
+    // Every node that hears the beacon shares this one copy of the schedule
+    frame->setSchedule(std::make_shared<const LoRaTDMASchedule>(std::move(pageTimeslots)));
+
+    // The beacon is only as long as the encoded schedule, and so is its time on air
+    size_t numberOfEntries = shortIds.size();
+    b scheduleLength;
+    BeaconEncoding encoding = chooseBeaconEncoding(shortIds, numberOfIds, scheduleLength);
+    frame->setBeaconEncoding(encoding);
+    if (spreadFactorLayers > 1) {
+        // The position no longer tells where an entry belongs: an SF per entry and the occupancy of every cell
+        scheduleLength += b(3 * numberOfEntries + 3 * usedTimeSlots * numberOfChannels);
+    }
+    if (clusterScheduler != nullptr || paged)
+        scheduleLength += b(16 + 16); // Uplink and beacon phase offset, in simtime resolution
+    if (paged)
+        scheduleLength += b(16 + 16 + 16); // Page index, number of pages and the length of the beacon period
+    if (overTheAirJoin)
+        scheduleLength += b(8 + 8 + 48 * accepted.size()); // Join window, number of accepts and their addresses
+    if (acknowledgeUplinks)
+        scheduleLength += b(frame->getAckBitmapArraySize()); // The nodes know the length from the last beacon
+    if (maxDownlinkBytes > B(0))
+        scheduleLength += b(8 + (bitsFor(numberOfNodes) + 8) * downlinks.size()); // Number of downlinks, then a short ID (all ones for everybody) and length each
+    if (variableSlotLength || enforceDutyCycle)
+        scheduleLength += b(16); // Uplink length in slotResolution, it no longer follows from the number of slots
+    if (variableSlotLength) {
+        // A 16 bit offset in slotResolution per time slot, and the SF of every entry when there are no layers to carry it.
+        // A page only needs the time slots it lists, with the start of the one after each
+        scheduleLength += paged ? b(32 * pageTimeSlots.size()) : b(16 * usedTimeSlots);
+        if (spreadFactorLayers == 1)
+            scheduleLength += b(3 * numberOfEntries);
+    }
+    frame->setChunkLength(b(16+16+2+4) + scheduleLength);
+    int beaconBytes = (frame->getChunkLength().get() + 7) / 8 + downlinkLength.get();
+    simtime_t beaconAirtime = LoRaAirtime::getAirtime(LoRaGWRadio::beaconSpreadFactor, Hz(LoRaGWRadio::beaconBandwidth), LoRaGWRadio::beaconCodeRendundance, beaconBytes);
+    EV_DETAIL << "Beacon page " << currentPage << "/" << numberOfPages << " encoding: " << (int)encoding << ", " << beaconBytes << " bytes, " << beaconAirtime << "s on air" << endl;
+    if (startTransmitOffset + beaconAirtime > txslotDuration)
+        EV_WARN << "Beacon of " << beaconAirtime << "s does not fit in the broadcast slot of " << txslotDuration << "s" << endl;
+    numBeacons++;
+    totalBeaconAirtime += beaconAirtime;
+    lastBeaconAirtime = beaconAirtime;
+
+    // Alone we know exactly how long this beacon is, so the next one is only as late as it has to be
+    if (enforceDutyCycle && clusterScheduler == nullptr)
+        stretchCycle(startTransmitOffset + beaconAirtime + joinWindow + uplinkLength + broadcastGuard, getMinCycleLength(beaconAirtime));
+    frame->setUplinkLength(SIMTIME_AS_CLOCKTIME(uplinkLength));
+
+    // The nodes receive the beacon when it has been sent completely, that is the time we hand them
+    simtime_t beaconEnd = simTime() + beaconAirtime;
+    frame->setSyncTime(SIMTIME_AS_CLOCKTIME(beaconEnd));
+
+    // With several gateways the uplinks of every cell start after the last beacon of the period, not after ours
+    if (clusterScheduler != nullptr) {
+        uplinkStart = cycleStart + txslotDuration * numberOfGateways;
+        frame->setUplinkOffset(SIMTIME_AS_CLOCKTIME(uplinkStart - beaconEnd));
+        frame->setBeaconPhaseOffset(SIMTIME_AS_CLOCKTIME(txslotDuration * gatewayIndex));
+    }
+    else if (paged) {
+        // The same for the pages of one gateway
+        frame->setUplinkOffset(SIMTIME_AS_CLOCKTIME(uplinkStart - beaconEnd));
+        frame->setBeaconPhaseOffset(SIMTIME_AS_CLOCKTIME(txslotDuration * currentPage));
+        frame->setBeaconPeriod(SIMTIME_AS_CLOCKTIME(txslotDuration * numberOfPages));
+    }
+    else {
+        // Join requests are sent between the beacon and the uplink slots
+        uplinkStart = beaconEnd + joinWindow;
+        frame->setUplinkOffset(SIMTIME_AS_CLOCKTIME(joinWindow));
+    }
+    pkt->insertAtFront(frame);
+    for (auto payload : cycleBroadcasts)
+        pkt->insertAtBack(payload->peekData());
+    for (auto payload : downlinkPayloads) {
+        pkt->insertAtBack(payload->peekData());
+        delete payload;
+    }
+    pkt->addTagIfAbsent<PacketProtocolTag>()->setProtocol(&Protocol::apskPhy);
+
+    // Our slot ends with the beacon, the first uplink slot follows right after
+    cancelEvent(endTXSlot);
+    scheduleAt(simTime() + beaconAirtime, endTXSlot);
+
+    sendDown(pkt);
 }
 
 void LoRaTDMAGWMac::handleState(cMessage *msg)
@@ -181,27 +1175,24 @@ void LoRaTDMAGWMac::handleState(cMessage *msg)
 
     case TRANSMIT:
         if (msg == startTransmit) {
-            Packet *pkt = new Packet("GatewayBroadcast");
-            IntrusivePtr<LoRaTDMAGWFrame> frame = makeShared<LoRaTDMAGWFrame>();
-            frame->setTransmitterAddress(address);
-            frame->setSyncTime(SIMTIME_AS_CLOCKTIME(simTime()) + ClockTime(6.42)); // FIXME: Calculated the extra time
-            frame->setUsedTimeSlots(100);
-            createTimeslots();
-            std::vector<MacAddress>& vecRef = *timeslots;
-            for (size_t i = 0; i < timeslots->size(); i++) {
-                frame->setTimeslots(i, vecRef[i]);
-            }
-            frame->setChunkLength(b(10+16+10*100)); // Calculated for now
-            pkt->insertAtFront(frame);
-            pkt->addTagIfAbsent<PacketProtocolTag>()->setProtocol(&Protocol::apskPhy);
-
-            sendDown(pkt);
+            // The schedule is made once per cycle, its pages go out one after another
+            if (currentPage == 0)
+                startCycle();
+            sendBeaconPage();
         } else if (msg == endTXSlot) {
             radio->setRadioMode(IRadio::RADIO_MODE_RECEIVER);
             EV_DETAIL << "transition: TRANSMIT -> RECEIVE" << endl;
             macState = RECEIVE;
-            // Schedule next broadcast
-            simtime_t txStartTime = simTime() + rxslotDuration*100 + broadcastGuard; // Check if broadcast does not exceed 20sec in total because it is now dynamic
+            // Schedule next broadcast: the next page of this cycle, or our own part of the next beacon period
+            simtime_t txStartTime = uplinkStart + uplinkLength + broadcastGuard + txslotDuration * gatewayIndex;
+            if (++currentPage < numberOfPages)
+                txStartTime = cycleStart + txslotDuration * currentPage;
+            else {
+                currentPage = 0;
+                for (auto payload : cycleBroadcasts)
+                    delete payload;
+                cycleBroadcasts.clear();
+            }
             simtime_t txEndTime = txStartTime + txslotDuration;
             EV << "TX slot START time set in simtime: " << txStartTime << endl;
             EV << "TX slot END time set in simtime: " << txEndTime << endl;
@@ -215,6 +1206,8 @@ void LoRaTDMAGWMac::handleState(cMessage *msg)
     case RECEIVE:
         if (msg == startTXSlot)
         {
+            if (currentPage == 0)
+                cycleStart = simTime() - txslotDuration * gatewayIndex;
             radio->setRadioMode(IRadio::RADIO_MODE_TRANSMITTER);
             EV_DETAIL << "transition: RECEIVE -> TRANSMIT" << endl;
             macState = TRANSMIT;
@@ -24,10 +24,14 @@
 #include "inet/linklayer/common/MacAddressTag_m.h"
 #include "inet/common/ModuleAccess.h"
 #include <vector>
+#include <map>
+#include <deque>
+#include <unordered_set>
 
 #include "LoRaTDMAMac.h"
 #include "LoRaTDMAMacFrame_m.h"
-#include "LoRaTDMAGWFrame_m.h"
+#include "LoRaTDMAGWFrame.h"
+#include "LoRaTDMAClientRegistry.h"
 
 #if INET_VERSION < 0x0403 || ( INET_VERSION == 0x0403 && INET_PATCH_LEVEL == 0x00 )
 #  error At least INET 4.3.1 is required. Please update your INET dependency and fully rebuild the project.
@@ -37,15 +41,19 @@ namespace flora_tdma {
 using namespace inet;
 using namespace inet::physicallayer;
 
-constexpr int MAX_MAC_ADDR_GW_FRAME = 1000; // If change remember to change it in the .msg file also 
+constexpr int MAX_TIME_SLOTS = 0xFFFF; // The beacon counts the time slots of a cycle in 16 bits
+constexpr int MAX_CHANNELS = 16; // The channel index is 4 bits on air
+
+class LoRaTDMAClusterScheduler;
 
 class LoRaTDMAGWMac: public MacProtocolBase {
+    friend class LoRaTDMAClusterScheduler;
 public:
+    virtual ~LoRaTDMAGWMac();
     virtual void initialize(int stage) override;
     virtual void finish() override;
     virtual void configureNetworkInterface() override;
     long GW_forwardedDown;
-    long GW_droppedDC;
     int numberOfNodes;
     simtime_t txslotDuration;
     simtime_t rxslotDuration;
@@ -53,12 +61,132 @@ public:
     simtime_t startTransmitOffset;
     simtime_t firstTXSlot;
 
+    /** @name Superframe sizing */
+    //@{
+    bool adaptiveSuperframe;
+    int numberOfTimeSlots; // Used when the superframe is not adaptive
+    int minTimeSlots;
+    int maxTimeSlots;
+    int slotsPerClient;
+    long receivedInCycle; // Uplinks heard since the last broadcast
+    //@}
+
+    /** @name Channel plan */
+    //@{
+    std::vector<double> channelFrequencies; // In MHz, the index is the channel number in the beacon
+    int numberOfChannels;
+    //@}
+
+    /** @name Spreading factor layers */
+    //@{
+    int spreadFactorLayers; // 1 means every node on SF12, alone in its cell
+    double linkMargin; // dB
+    double captureMargin; // dB
+    //@}
+
+    /** @name Slot lengths */
+    //@{
+    bool variableSlotLength; // Size every time slot to the airtime of the nodes in it instead of rxslotDuration
+    double clockDrift; // ppm, the nodes' clocks drift apart from ours by up to this much since the beacon
+    simtime_t slotResolution; // Slot offsets in the beacon are multiples of this
+    std::vector<simtime_t> slotLengths; // Per time slot of this cycle
+    simtime_t uplinkLength; // All time slots of this cycle
+    //@}
+
+    /** @name Acknowledgements */
+    //@{
+    bool acknowledgeUplinks; // Put a bitmap of the received uplinks in the next beacon
+    std::vector<bool> uplinkReceived; // Per entry of the last beacon's schedule
+    std::vector<std::vector<int>> clientEntries; // Per client, its entries in the last beacon's schedule
+    std::vector<simtime_t> slotStarts; // Per time slot of the last beacon, from the first one
+    //@}
+
+    /** @name Downlink mailbox */
+    //@{
+    B maxDownlinkBytes; // Payload per beacon, 0 when there is no mailbox
+    int mailboxSize; // Downlinks queued per node
+    std::map<MacAddress, std::deque<Packet *>> mailbox; // Per node, oldest first
+    MacAddress lastMailboxServed; // Every beacon starts with the node after it, so all get their turn
+    long numDownlinks;
+    long numDownlinksDropped;
+    //@}
+
+    /** @name Duty cycle */
+    //@{
+    bool enforceDutyCycle; // Stretch cycles so the beacon and every node's slots keep to the sub-band budgets
+    simtime_t lastBeaconAirtime; // Estimate for the next beacon when the cluster plans a cycle
+    //@}
+
+    /** @name Beacon pages */
+    //@{
+    int clientsPerPage; // Clients listed per beacon page, 0 for a single beacon
+    int numberOfPages = 1; // Pages of this cycle
+    int currentPage = 0; // Page sent in our next broadcast slot
+    std::vector<MacAddress> cycleAccepts; // Admitted at the start of this cycle, each listed on its own page
+    std::vector<std::vector<bool>> pageAcks; // Per page, the acknowledgements of the entries it listed last cycle
+    std::vector<Packet *> cycleBroadcasts; // Downlinks for everybody, repeated on every page
+    B cycleBroadcastLength = B(0);
+    //@}
+
+    /** @name Slot allocation */
+    //@{
+    enum SlotAllocation {
+      ROUND_ROBIN,
+      DEMAND,
+    };
+    SlotAllocation slotAllocation;
+    bool keepAliveSlot; // Give clients without backlog one slot to report new data in
+    double keepAliveShare; // Share of the cycle the keep-alives get at most while other clients have a backlog
+    //@}
+
+    /** @name Beacon encoding */
+    //@{
+    enum BeaconEncoding {
+      FULL,       // 48 bit MAC address per slot
+      SHORT_ID,   // short node ID per slot
+      RUN_LENGTH, // short node ID and number of consecutive slots per run
+      BITMAP,     // start offset, one bit per client and the number of slots of each flagged client
+      AUTO,       // smallest of the above that can represent the schedule
+    };
+    BeaconEncoding beaconEncoding;
+    //@}
+
+    /** @name Over-the-air join */
+    //@{
+    bool overTheAirJoin; // Clients register with a join request instead of being looked up in the network
+    simtime_t joinWindow; // Contention window for join requests between the beacon and the uplink slots
+    int maxJoinsPerCycle; // Most join accepts in one beacon
+    std::deque<MacAddress> pendingJoins; // Heard join requests waiting for an accept, oldest first
+    std::unordered_set<uint64_t> pendingJoinAddresses; // The same, to find repeated requests without a scan
+    long numJoinRequests;
+    simtime_t lastJoinTime; // When the last new client was admitted
+    //@}
+
+    /** @name Several gateways */
+    //@{
+    LoRaTDMAClusterScheduler *clusterScheduler = nullptr; // Only set when gateways share the network
+    int gatewayIndex = 0; // Our turn in the beacon period
+    int numberOfGateways = 1;
+    long cycle; // Beacons sent so far, the cluster computes each cycle once
+    simtime_t cycleStart; // Start of the beacon period, the first gateway's broadcast slot
+    simtime_t uplinkStart; // First uplink slot of this cycle
+    //@}
+
+    /** @name Statistics */
+    //@{
+    long totalTimeSlots;
+    long totalReceived;
+    long numUnplacedSlots; // Handed out, but no cell of the layered grid could take them
+    long numBeacons;
+    simtime_t totalBeaconAirtime;
+    //@}
+
     cMessage *startTXSlot;
     cMessage *endTXSlot;
     cMessage *startTransmit;
 
-    MacAddress clients[MAX_MAC_ADDR_GW_FRAME] = { inet::MacAddress("00:00:00:00:00:00") };
-    std::vector<MacAddress> *timeslots;
+    LoRaTDMAClientRegistry clients; // The index is the short ID
+    std::vector<LoRaTDMATimeslot> *timeslots;
     size_t nextNodeInTimeSlotQueue;
 
     int usedTimeSlots;
@@ -74,6 +202,7 @@ public:
     States macState;
 
     virtual void handleLowerMessage(cMessage *msg) override;
+    virtual void handleUpperPacket(Packet *packet) override;
     virtual void handleSelfMessage(cMessage *message) override;
     
     virtual MacAddress getAddress();
@@ -84,7 +213,35 @@ protected:
     IRadio *radio = nullptr;
     IRadio::TransmissionState transmissionState = IRadio::TRANSMISSION_STATE_UNDEFINED;
 
+    virtual int findClient(const MacAddress& clientAddress) const;
+    virtual int addClient(const MacAddress& clientAddress);
+    virtual void admitPendingJoins(std::vector<MacAddress>& accepted);
+    virtual int getDemand(size_t clientIndex) const;
+    virtual int computeUsedTimeSlots();
     virtual void createTimeslots();
+    virtual void createCellTimeslots();
+    virtual void fitSlotAirtimes(std::vector<simtime_t>& slotAirtimes, std::vector<double>& slotDrifts) const;
+    virtual void setSlotLengths(const std::vector<simtime_t>& slotAirtimes, const std::vector<double>& slotDrifts);
+    virtual double getClientDrift(size_t clientIndex) const;
+    virtual B collectDownlinks(std::vector<LoRaTDMADownlink>& downlinks, std::vector<Packet *>& payloads, int page, B budget);
+    virtual int findTimeslotEntry(int clientIndex, simtime_t receptionStart) const;
+    virtual simtime_t getMinCycleLength(simtime_t beaconAirtime) const;
+    virtual void stretchCycle(simtime_t cycleLength, simtime_t minCycleLength);
+    virtual void orderByDrift(std::vector<int>& sequence) const;
+    virtual void createRoundRobinTimeslots(std::vector<int>& sequence);
+    virtual void createDemandTimeslots(std::vector<int>& sequence);
+    virtual int getCellsPerTimeSlot() const { return numberOfChannels * spreadFactorLayers; }
+    virtual void placeTimeslots(std::vector<int>& sequence);
+    virtual void placeLayeredTimeslots(std::vector<int>& sequence);
+    virtual int getSpreadFactor(size_t clientIndex) const;
+    virtual int getLowestSpreadFactor(double rssi) const;
+    virtual bool isCaptureSafe(size_t clientA, size_t clientB) const;
+    virtual int getShortIdBits(int numberOfIds) const;
+    virtual b getScheduleLength(BeaconEncoding encoding, const std::vector<int>& shortIds, int numberOfIds) const;
+    virtual BeaconEncoding chooseBeaconEncoding(const std::vector<int>& shortIds, int numberOfIds, b& scheduleLength) const;
+    virtual int getPage(int clientIndex) const { return clientsPerPage > 0 && clientIndex >= 0 ? clientIndex / clientsPerPage : 0; }
+    virtual void startCycle();
+    virtual void sendBeaconPage();
     virtual void handleState(cMessage *msg);
 
     virtual void receiveSignal(cComponent *source, simsignal_t signalID, intval_t value, cObject *details) override;
@@ -23,6 +23,9 @@
 #include "LoRaTagInfo_m.h"
 #include "inet/common/ProtocolTag_m.h"
 #include "inet/linklayer/common/InterfaceTag_m.h"
+#include "../LoRaPhy/LoRaAirtime.h"
+#include <algorithm>
+#include <cmath>
 
 #define CHECKCLEV(clev, value) clev && clev == value
 
@@ -47,6 +50,10 @@ LoRaTDMAMac::~LoRaTDMAMac()
     cancelAndDelete(endReception);
     cancelAndDelete(mediumStateChange);
     cancelAndDelete(endRXEarly);
+    for (auto& pending : sentFrames)
+        delete pending.frame;
+    for (auto& pending : retransmissions)
+        delete pending.frame;
 
     /* What about the Queue? Perhaps clearQueue() */
 }
@@ -79,6 +86,32 @@ void LoRaTDMAMac::initialize(int stage)
         broadcastGuard = par("broadcastGuard");
         startTransmitOffset = par("startTransmitOffset");
         firstRxSlot = par("firstRxSlot");
+        for (auto frequency : cStringTokenizer(par("channelFrequencies")).asDoubleVector())
+            channelFrequencies.push_back(MHz(frequency));
+        if (channelFrequencies.empty())
+            throw cRuntimeError("At least one channel is required in channelFrequencies");
+        currentTxFrequency = channelFrequencies[0];
+        currentTxSpreadFactor = 12;
+
+        driftCompensation = par("driftCompensation");
+        driftEstimate = 0;
+        driftResidual = 0;
+        numDriftEstimates = 0;
+        lastSyncTime = -1;
+        enforceDutyCycle = par("enforceDutyCycle");
+        retryLimit = par("retryLimit");
+        currentEntry = -1;
+        listenDuration = rxslotDuration;
+        pageSearchLimit = par("pageSearchLimit");
+        pageSearchBackoffLimit = par("pageSearchBackoffLimit");
+
+        // Without over-the-air join the gateway knows us from the start, and we know when it sends its first beacon
+        overTheAirJoin = par("overTheAirJoin");
+        joinBackoffLimit = par("joinBackoffLimit");
+        synchronized = !overTheAirJoin;
+        joined = !overTheAirJoin;
+        joinPending = false;
+        joinBackoff = 0;
 
         // subscribe for the information of the carrier sense
         cModule *radioModule = getModuleFromPar<cModule>(par("radioModule"), this);
@@ -114,6 +147,12 @@ void LoRaTDMAMac::initialize(int stage)
         // statistics
         numSent = 0;
         numReceived = 0;
+        numJoinRequests = 0;
+        numSkippedDutyCycle = 0;
+        numAcknowledged = 0;
+        numRetransmissions = 0;
+        numDroppedRetryLimit = 0;
+        joinTime = -1;
 
         // initialize watches
         WATCH(numSent);
@@ -132,6 +171,17 @@ void LoRaTDMAMac::finish()
 {
     recordScalar("numSent", numSent);
     recordScalar("numReceived", numReceived);
+    recordScalar("numAcknowledged", numAcknowledged);
+    recordScalar("numRetransmissions", numRetransmissions);
+    recordScalar("numDroppedRetryLimit", numDroppedRetryLimit);
+    if (enforceDutyCycle)
+        recordScalar("numSkippedDutyCycle", numSkippedDutyCycle);
+    if (driftCompensation)
+        recordScalar("driftEstimate", driftEstimate);
+    if (overTheAirJoin) {
+        recordScalar("numJoinRequests", numJoinRequests);
+        recordScalar("joinTime", joinTime);
+    }
 }
 
 /*
@@ -182,28 +232,94 @@ void LoRaTDMAMac::handleLowerPacket(Packet *msg)
         const auto &chunk = msg->peekAtFront<Chunk>();
         Ptr<LoRaTDMAGWFrame> frame = dynamicPtrCast<LoRaTDMAGWFrame>(constPtrCast<Chunk>(chunk));
 
+        // An uplink of another node, a neighbouring cell's beacon or another page of ours can arrive while we listen for our own
+        bool otherPage = frame != nullptr && frame->getNumberOfPages() > 1 && beaconPage >= 0 && frame->getPageIndex() != beaconPage;
+        if (frame == nullptr || otherPage || (!homeGateway.isUnspecified() && frame->getTransmitterAddress() != homeGateway)) {
+            if (frame == nullptr)
+                EV << "Not a beacon, discarding: " << msg << endl;
+            else if (otherPage)
+                EV << "Ignoring beacon page " << frame->getPageIndex() << ", ours is " << beaconPage << endl;
+            else
+                EV << "Ignoring beacon from " << frame->getTransmitterAddress() << ", our gateway is " << homeGateway << endl;
+            radio->setRadioMode(IRadio::RADIO_MODE_RECEIVER);
+            EV_DETAIL << "transition: RECEIVE -> LISTEN" << endl;
+            macState = LISTEN;
+            delete msg;
+            return;
+        }
 
         // Update our clock
         clocktime_t synctime = frame->getSyncTime();
-        clock->setClockTime(synctime);
+        synchronizeClock(synctime);
+        synchronized = true;
+
+        // A paged beacon only lists the nodes of its page. Until one lists us we look at every page
+        int numberOfPages = frame->getNumberOfPages();
+        int pageIndex = frame->getPageIndex();
+        if (numberOfPages > 1 && beaconPage < 0 && isListed(frame.get())) {
+            beaconPage = pageIndex;
+            pageSearchMisses = 0;
+            pageSearchBackoff = 0;
+            EV << "Our beacon page is " << beaconPage << " of " << numberOfPages << endl;
+        }
+        bool searching = numberOfPages > 1 && beaconPage < 0;
+        // Backing off, we only listened to page 0. It still brings the sync, the downlinks for everybody and the join window
+        bool backingOff = searching && pageSearchBackoff > 0;
+        bool lastPage = !searching || backingOff || pageIndex == numberOfPages - 1;
+        if (backingOff)
+            pageSearchBackoff--;
+        else if (searching && lastPage && ++pageSearchMisses >= pageSearchLimit) {
+            // No page lists us, so the gateway does not know us yet. Searching every beacon period would keep us awake for all pages
+            pageSearchBackoff = 1 << std::min(pageSearchMisses - pageSearchLimit + 1, pageSearchBackoffLimit);
+            EV << "No page lists us after " << pageSearchMisses << " search(es), listening to page 0 only for " << pageSearchBackoff << " beacon period(s)" << endl;
+        }
+
+        // What the gateway heard of our last uplinks, before the slots they were sent in are forgotten.
+        // Every page repeats the downlinks for everybody, while searching we take them from the last one we listen to
+        if (!searching)
+            handleAcknowledgements(frame.get());
+        if (lastPage)
+            handleDownlinks(msg, frame.get());
 
         // Check if we have a time slot
         // TODO: Check and save what receive windows we have been given and use them
         auto timeslotarraysize = frame->getUsedTimeSlots();
         nextTimeSlots = {};
+        nextTimeSlotEntries = {};
         EV << "The broadcasted timeslot size is: " << timeslotarraysize << endl;
-        for (int i = 0; i < timeslotarraysize; i++)
+        // The schedule indexes the entries of every node, already in time order
+        const LoRaTDMASchedule& schedule = frame->getSchedule();
+        LoRaTDMASchedule::Entries ourTimeSlots = schedule.findEntries(address);
+        for (int entry : ourTimeSlots)
         {
-            MacAddress timeslotAddr = frame->getTimeslots(i);
-            if (timeslotAddr == address)
-            {
-                // We found ourself. Note the index. That is the time_index we can transmit
-                nextTimeSlots.push(i);
-                EV << "We got to TX in slot number: " << i << endl;
-            }
+            // We found ourself. The timeslot is when we can transmit, the channel where
+            const LoRaTDMATimeslot& timeslot = schedule[entry];
+            if (timeslot.channel >= channelFrequencies.size())
+                throw cRuntimeError("Beacon uses channel %d, but we only know %d", (int)timeslot.channel, (int)channelFrequencies.size());
+            if (timeslot.spreadFactor < 7 || timeslot.spreadFactor > 12)
+                throw cRuntimeError("Beacon uses invalid SF%d", (int)timeslot.spreadFactor);
+            nextTimeSlots.push(timeslot);
+            nextTimeSlotEntries.push(entry);
+            EV << "We got to TX in slot number: " << timeslot.timeslot << " on channel " << (int)timeslot.channel << " with SF" << (int)timeslot.spreadFactor << endl;
         }
 
-        lastRXendTime = endRXSlot->getArrivalClockTime();
+        // Being in the schedule tells us we were admitted as well as the accept does
+        for (size_t i = 0; !joined && i < frame->getJoinAcceptsArraySize(); i++)
+            joined = frame->getJoinAccepts(i) == address;
+        if (!joined && !ourTimeSlots.empty())
+            joined = true;
+        if (joined && joinTime < 0) {
+            joinTime = simTime() - CLOCKTIME_AS_SIMTIME(firstRxSlot);
+            EV << "Joined the gateway after " << joinTime << "s and " << numJoinRequests << " join request(s)" << endl;
+        }
+
+        // The gateway hands out the end of its beacon as sync time, every slot is counted from there.
+        // With several gateways the uplink slots of all cells start together, after the last beacon
+        lastRXendTime = synctime + frame->getUplinkOffset();
+        uplinkLength = frame->getUplinkLength();
+        slotOffsets.clear();
+        for (size_t i = 0; i < frame->getSlotOffsetsArraySize(); i++)
+            slotOffsets.push_back(frame->getSlotOffsets(i));
         
         if (nextTimeSlots.empty()) {
             EV << "No timeslot for me" << endl;
@@ -217,14 +333,48 @@ void LoRaTDMAMac::handleLowerPacket(Packet *msg)
          */
 
         // This does not work, as we wait waaaaayy too long (because there is often not 1000 nodes)
-        clocktime_t rxSlotStartTime = txslotDuration*timeslotarraysize + broadcastGuard + lastRXendTime;
+        clocktime_t rxSlotStartTime = uplinkLength + broadcastGuard + lastRXendTime + frame->getBeaconPhaseOffset();
+        listenDuration = rxslotDuration;
+        if (searching) {
+            // No page has listed us, so next cycle we listen to all of them from the first, or to the first only while backing off
+            rxSlotStartTime -= frame->getBeaconPhaseOffset();
+            if (pageSearchBackoff == 0)
+                listenDuration = frame->getBeaconPeriod();
+        }
         EV << "RX slot START time set on the clock: " << rxSlotStartTime << endl;
-        EV << "RX slot END time set on the clock: " << rxSlotStartTime + rxslotDuration << endl;
+        EV << "RX slot END time set on the clock: " << rxSlotStartTime + listenDuration << endl;
+        clock->cancelClockEvent(startRXSlot); // A later page may get here before the next receive slot
         clock->cancelClockEvent(endRXSlot); // Cancel the event before rescheduling
         clock->scheduleClockEventAt(rxSlotStartTime, startRXSlot); // Schedule the next receive slot to listen to the gateway
-        clock->scheduleClockEventAt(rxSlotStartTime + rxslotDuration, endRXSlot); // And the end
+
+        // The rest of the pages follow right after this one, we keep listening until the last has been sent.
+        // The end of the next receive slot is then set when it starts
+        bool morePages = !lastPage;
+        if (morePages)
+            clock->scheduleClockEventAt(lastRXendTime - frame->getJoinWindow(), endRXSlot);
+        else
+            clock->scheduleClockEventAt(rxSlotStartTime + listenDuration, endRXSlot); // And the end
+
+        // Not admitted yet, ask in the join window between the (last) beacon and the first uplink slot
+        if (!joined && !morePages) {
+            clocktime_t joinWindow = frame->getJoinWindow();
+            if (joinWindow.isZero())
+                EV_WARN << "Gateway " << frame->getTransmitterAddress() << " does not take join requests" << endl;
+            else if (joinBackoff > 0) {
+                EV << "Backing off from joining for " << joinBackoff << " more beacon(s)" << endl;
+                joinBackoff--;
+            }
+            else
+                scheduleJoinRequest(lastRXendTime - joinWindow, joinWindow);
+        }
         delete msg;
-        handleState(endRXEarly);
+        if (morePages) {
+            radio->setRadioMode(IRadio::RADIO_MODE_RECEIVER);
+            EV_DETAIL << "transition: RECEIVE -> LISTEN" << endl;
+            macState = LISTEN;
+        }
+        else
+            handleState(endRXEarly);
     } else {
         EV << "Got message from lower layer: " << msg << ". But not in RECEIVE, discarding" << endl;
         EV_DEBUG << "macState: " << macState << endl;
@@ -284,7 +434,7 @@ void LoRaTDMAMac::handleState(cMessage *msg)
     case SLEEP:
         if (CHECKCLEV(msgclev, startTXSlot)) { // Transmission slot (aka my slot) has begun
             
-            if(txQueue->isEmpty()) {
+            if(txQueue->isEmpty() && retransmissions.empty() && !joinPending) {
                 /* If there is nothing in the queue,
                  * there is no reason to turn on the transmitter and send
                  */
@@ -296,12 +446,27 @@ void LoRaTDMAMac::handleState(cMessage *msg)
                 return;
             }
 
+            // A join request always goes out on the first channel
+            Hz slotFrequency = joinPending ? channelFrequencies[0] : currentTxFrequency;
+            if (enforceDutyCycle && check_and_cast<LoRaRadio *>(radio)->getDutyCycleLedger().getAvailableAt(slotFrequency) > simTime()) {
+                EV << "Sub-band of " << slotFrequency << " is in its off-time, skipping the slot" << endl;
+                numSkippedDutyCycle++;
+                joinPending = false; // Retried after the backoff, like an unanswered one
+                clock->cancelClockEvent(endTXSlot);
+                clock->cancelClockEvent(startTransmit);
+                if (!nextTimeSlots.empty())
+                    handleNextTXSlot();
+                return;
+            }
+
             radio->setRadioMode(IRadio::RADIO_MODE_TRANSMITTER);
 
             EV_DETAIL << "transition: SLEEP -> TRANSMIT" << endl;
             macState = TRANSMIT;
 
         } else if (CHECKCLEV(msgclev, startRXSlot)) { // The gateways broadcast slot (receive slot) has begun
+            if (!endRXSlot->isScheduled())
+                clock->scheduleClockEventAfter(listenDuration, endRXSlot);
             radio->setRadioMode(IRadio::RADIO_MODE_RECEIVER);
             EV_DETAIL << "transition: SLEEP -> LISTEN" << endl;
             macState = LISTEN;
@@ -309,10 +474,27 @@ void LoRaTDMAMac::handleState(cMessage *msg)
         break;
 
     case TRANSMIT:
-        if (CHECKCLEV(msgclev, startTransmit)) { // Actually send now
+        if (CHECKCLEV(msgclev, startTransmit) && joinPending) { // Our pick in the join window
+            EV << "Sending join request" << endl;
+            joinPending = false;
+            sendDown(createJoinRequest());
+        } else if (CHECKCLEV(msgclev, startTransmit)) { // Actually send now
             EV << "Starting to transmit" << endl;
-            processUpperPacket();
+            int retries = 0;
+            if (!retransmissions.empty()) {
+                // The slot may be on another channel and SF than last time, and the backlog has changed
+                PendingFrame pending = retransmissions.front();
+                retransmissions.pop_front();
+                pending.frame->removeAtFront<LoRaTDMAMacFrame>();
+                currentTxFrame = encapsulate(pending.frame);
+                retries = pending.retries;
+                numRetransmissions++;
+                EV << "Retransmitting " << currentTxFrame << ", retry " << retries << endl;
+            }
+            else
+                processUpperPacket();
             ASSERT(currentTxFrame);
+            sentFrames.push_back({currentTxFrame->dup(), currentEntry, retries});
             sendDown(currentTxFrame);
         } else if (CHECKCLEV(msgclev, endTXSlot)) { // End of the transmission slot
             radio->setRadioMode(IRadio::RADIO_MODE_SLEEP);
@@ -325,7 +507,9 @@ void LoRaTDMAMac::handleState(cMessage *msg)
         break;
 
     case LISTEN:
-        if (CHECKCLEV(msgclev, endRXSlot)) { // End of the receive slot
+        if (CHECKCLEV(msgclev, endRXSlot) && !synchronized) { // No beacon heard yet, so we do not know when the next one comes
+            clock->scheduleClockEventAfter(rxslotDuration, endRXSlot);
+        } else if (CHECKCLEV(msgclev, endRXSlot)) { // End of the receive slot
             radio->setRadioMode(IRadio::RADIO_MODE_SLEEP);
             EV_DETAIL << "transition: LISTEN -> SLEEP" << endl;
             macState = SLEEP;
@@ -338,7 +522,14 @@ void LoRaTDMAMac::handleState(cMessage *msg)
         break;
 
     case RECEIVE:
-        if (CHECKCLEV(msgclev, endRXSlot) || msg == endRXEarly) { // End of the receive slot
+        if (CHECKCLEV(msgclev, endRXSlot) && !synchronized) { // Keep listening for a beacon, unless one is arriving right now
+            clock->scheduleClockEventAfter(rxslotDuration, endRXSlot);
+            if (radio->getReceptionState() != IRadio::RECEPTION_STATE_RECEIVING) {
+                radio->setRadioMode(IRadio::RADIO_MODE_RECEIVER);
+                EV_DETAIL << "transition: RECEIVE -> LISTEN" << endl;
+                macState = LISTEN;
+            }
+        } else if (CHECKCLEV(msgclev, endRXSlot) || msg == endRXEarly) { // End of the receive slot
 
             // TODO: cancel reception
             
@@ -356,8 +547,11 @@ void LoRaTDMAMac::handleState(cMessage *msg)
 
 void LoRaTDMAMac::handleNextTXSlot() 
 {
-    int timeslotIdx = nextTimeSlots.front();
-    EV << "Trying to use timeslot: " << timeslotIdx << endl;
+    int timeslotIdx = nextTimeSlots.front().timeslot;
+    currentTxFrequency = channelFrequencies[nextTimeSlots.front().channel];
+    currentTxSpreadFactor = nextTimeSlots.front().spreadFactor;
+    currentEntry = nextTimeSlotEntries.front();
+    EV << "Trying to use timeslot: " << timeslotIdx << " at " << currentTxFrequency << " SF" << currentTxSpreadFactor << endl;
 
     /* Calculate the clock time when we can send, this is based on 3 things:
     * 1. The Duration of a txSlot times our timeslotIdx (so the times of all transmissions before ours)
@@ -365,14 +559,151 @@ void LoRaTDMAMac::handleNextTXSlot()
     * 3. The end of the receive slot (as given by the arrival clock of the endRXSlot)
     */
     clocktime_t txSlotStartTime = txslotDuration*timeslotIdx + broadcastGuard + lastRXendTime;
+    clocktime_t txSlotDuration = txslotDuration;
+    if (!slotOffsets.empty()) {
+        // The gateway sized every slot to the transmissions in it
+        if (timeslotIdx >= (int)slotOffsets.size())
+            throw cRuntimeError("Beacon gives us slot %d, but only has offsets for %d", timeslotIdx, (int)slotOffsets.size());
+        txSlotStartTime = slotOffsets[timeslotIdx] + broadcastGuard + lastRXendTime;
+        txSlotDuration = (timeslotIdx + 1 < (int)slotOffsets.size() ? slotOffsets[timeslotIdx + 1] : uplinkLength) - slotOffsets[timeslotIdx];
+    }
     EV << "TX slot START time set on the clock: " << txSlotStartTime << endl;
-    EV << "TX slot END time set on the clock: " << txSlotStartTime + txslotDuration << endl;
+    EV << "TX slot END time set on the clock: " << txSlotStartTime + txSlotDuration << endl;
     EV << "Start of us transmitting set on the clock: " << txSlotStartTime + startTransmitOffset << endl;
     clock->scheduleClockEventAt(txSlotStartTime, startTXSlot); // Schedule our transmission slot
-    clock->scheduleClockEventAt(txSlotStartTime + txslotDuration, endTXSlot); // Schedule the end of our transmission slot
+    clock->scheduleClockEventAt(txSlotStartTime + txSlotDuration, endTXSlot); // Schedule the end of our transmission slot
     clock->scheduleClockEventAt(txSlotStartTime + startTransmitOffset, startTransmit); // The actual point that we start to transmit
 
     nextTimeSlots.pop();
+    nextTimeSlotEntries.pop();
+}
+
+void LoRaTDMAMac::handleDownlinks(Packet *beacon, const LoRaTDMAGWFrame *frame)
+{
+    // The payloads follow the beacon frame in the order the beacon lists them
+    b offset = frame->getChunkLength();
+    for (size_t i = 0; i < frame->getDownlinksArraySize(); i++) {
+        const LoRaTDMADownlink& downlink = frame->getDownlinks(i);
+        if (downlink.address == address || downlink.address.isBroadcast()) {
+            Packet *packet = new Packet("Downlink", beacon->peekDataAt(offset, downlink.length));
+            EV << "Downlink from the mailbox, passing it up: " << packet << endl;
+            numReceived++;
+            sendUp(packet);
+        }
+        offset += downlink.length;
+    }
+}
+
+bool LoRaTDMAMac::isListed(const LoRaTDMAGWFrame *frame) const
+{
+    // Slots, an accept or a downlink for us only go on our own page
+    if (frame->getSchedule().contains(address))
+        return true;
+    for (size_t i = 0; i < frame->getJoinAcceptsArraySize(); i++)
+        if (frame->getJoinAccepts(i) == address)
+            return true;
+    for (size_t i = 0; i < frame->getDownlinksArraySize(); i++)
+        if (frame->getDownlinks(i).address == address)
+            return true;
+    return false;
+}
+
+void LoRaTDMAMac::handleAcknowledgements(const LoRaTDMAGWFrame *frame)
+{
+    /* The bitmap has a bit per entry of the last beacon's schedule. A gateway that does not
+     * acknowledge sends none, and then our uplinks were fire-and-forget.
+     */
+    bool acknowledging = frame->getAckBitmapArraySize() > 0;
+    for (auto& pending : sentFrames) {
+        if (!acknowledging) {
+            delete pending.frame;
+        }
+        else if (pending.entry >= 0 && pending.entry < (int)frame->getAckBitmapArraySize() && frame->getAckBitmap(pending.entry)) {
+            numAcknowledged++;
+            delete pending.frame;
+        }
+        else if (pending.retries < retryLimit) {
+            pending.retries++;
+            retransmissions.push_back(pending);
+        }
+        else {
+            EV_WARN << "Uplink " << pending.frame << " not acknowledged after " << retryLimit << " retries, dropping it" << endl;
+            numDroppedRetryLimit++;
+            delete pending.frame;
+        }
+    }
+    sentFrames.clear();
+}
+
+void LoRaTDMAMac::synchronizeClock(clocktime_t syncTime)
+{
+    if (!driftCompensation) {
+        clock->setClockTime(syncTime);
+        return;
+    }
+
+    /* What our clock gained on the gateway's since the last beacon is what the current
+     * compensation did not catch. The first measurement is taken as is, later ones are
+     * averaged in so a single late beacon does not throw the estimate off.
+     */
+    clocktime_t localTime = clock->getClockTime();
+    if (lastSyncTime >= 0 && syncTime > lastSyncTime) {
+        driftResidual = (localTime - syncTime).dbl() / (syncTime - lastSyncTime).dbl() * 1e6;
+        driftEstimate += numDriftEstimates == 0 ? driftResidual : 0.5 * driftResidual;
+        numDriftEstimates++;
+        EV_DETAIL << "Clock gained " << driftResidual << " ppm since the last beacon, drift estimate: " << driftEstimate << " ppm" << endl;
+    }
+    clock->setClockTime(syncTime, ppm(-driftEstimate), true);
+    lastSyncTime = syncTime;
+}
+
+int LoRaTDMAMac::getDriftClass() const
+{
+    // The first estimate only starts the compensation, the second shows how well it works
+    if (!driftCompensation || numDriftEstimates < 2)
+        return DRIFT_CLASSES - 1;
+    for (int driftClass = 0; driftClass < DRIFT_CLASSES - 1; driftClass++) {
+        if (std::abs(driftResidual) <= DRIFT_CLASS_PPM[driftClass])
+            return driftClass;
+    }
+    return DRIFT_CLASSES - 1;
+}
+
+void LoRaTDMAMac::scheduleJoinRequest(clocktime_t windowStart, clocktime_t windowLength)
+{
+    /* Slotted ALOHA: the join window is cut into slots of one request each and we pick one.
+     * After every request we let a random number of beacons pass, doubling the range
+     * each time, so a crowd of new nodes spreads out instead of colliding every cycle.
+     */
+    int requestBytes = (TDMA_HEADER_LENGTH.get() + 7) / 8;
+    clocktime_t requestSlot = startTransmitOffset + SIMTIME_AS_CLOCKTIME(LoRaAirtime::getAirtime(12, Hz(125000), 4, requestBytes));
+    int numberOfSlots = (int)(windowLength.dbl() / requestSlot.dbl());
+    if (numberOfSlots < 1) {
+        EV_WARN << "Join window of " << windowLength << "s is too short for a join request of " << requestSlot << "s" << endl;
+        return;
+    }
+    clocktime_t requestStart = windowStart + requestSlot * intuniform(0, numberOfSlots - 1);
+    numJoinRequests++;
+    joinBackoff = intuniform(0, (1 << std::min((int)numJoinRequests, joinBackoffLimit)) - 1);
+    joinPending = true;
+    EV << "Join request at " << requestStart << ", backing off " << joinBackoff << " beacon(s) if it is not answered" << endl;
+    clock->scheduleClockEventAt(requestStart, startTXSlot);
+    clock->scheduleClockEventAt(requestStart + startTransmitOffset, startTransmit);
+    clock->scheduleClockEventAt(requestStart + requestSlot, endTXSlot);
+}
+
+Packet *LoRaTDMAMac::createJoinRequest()
+{
+    // The gateway has never heard us, so we ask on the first channel with SF12
+    currentTxFrequency = channelFrequencies[0];
+    currentTxSpreadFactor = 12;
+    Packet *request = new Packet("JoinRequest");
+    request->addTagIfAbsent<PacketProtocolTag>()->setProtocol(&Protocol::apskPhy);
+    encapsulate(request);
+    auto frame = request->removeAtFront<LoRaTDMAMacFrame>();
+    frame->setFrameType(TDMA_JOIN_REQUEST);
+    request->insertAtFront(frame);
+    return request;
 }
 
 /*
@@ -399,17 +730,20 @@ void LoRaTDMAMac::receiveSignal(cComponent *source, simsignal_t signalID, intval
 Packet *LoRaTDMAMac::encapsulate(Packet *msg)
 {
     IntrusivePtr<LoRaTDMAMacFrame> frame = makeShared<LoRaTDMAMacFrame>();
-    frame->setChunkLength(b(10));
+    frame->setChunkLength(TDMA_HEADER_LENGTH);
 
     auto tag = msg->addTagIfAbsent<LoRaTag>();
     tag->setPower(mW(math::dBmW2mW(14)));
-    tag->setCenterFrequency(MHz(868));
+    tag->setCenterFrequency(currentTxFrequency);
     tag->setBandwidth(kHz(125));
     tag->setCodeRendundance(4);
-    tag->setSpreadFactor(12);
+    tag->setSpreadFactor(currentTxSpreadFactor);
     tag->setUseHeader(true);
 
     frame->setTransmitterAddress(address);
+    // Let the gateway know how much we still have queued, so it can size our slots next cycle
+    frame->setBacklog(std::min(txQueue->getNumPackets() + (int)retransmissions.size(), (int)MAX_BACKLOG));
+    frame->setDriftClass(getDriftClass());
     msg->insertAtFront(frame);
     return msg;
 }
@@ -458,4 +792,19 @@ MacAddress LoRaTDMAMac::getAddress()
     return address;
 }
 
+void LoRaTDMAMac::setHomeGateway(const MacAddress& gatewayAddress, clocktime_t beaconPhaseOffset)
+{
+    Enter_Method("setHomeGateway");
+    if (overTheAirJoin)
+        throw cRuntimeError("overTheAirJoin cannot be combined with a cluster scheduler, it assigns the nodes to the gateways");
+    homeGateway = gatewayAddress;
+
+    // Our gateway sends its first beacon in its own part of the beacon period, so we listen there
+    clock->cancelClockEvent(startRXSlot);
+    clock->cancelClockEvent(endRXSlot);
+    clock->scheduleClockEventAt(firstRxSlot + beaconPhaseOffset, startRXSlot);
+    clock->scheduleClockEventAt(firstRxSlot + beaconPhaseOffset + rxslotDuration, endRXSlot);
+    EV << "Home gateway is " << homeGateway << ", first beacon expected at " << firstRxSlot + beaconPhaseOffset << endl;
+}
+
 } // namespace flora
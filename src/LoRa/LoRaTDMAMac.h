@@ -6,7 +6,7 @@
 #include "inet/linklayer/base/MacProtocolBase.h"
 #include "inet/queueing/contract/IPacketQueue.h"
 #include "LoRaTDMAMacFrame_m.h"
-#include "LoRaTDMAGWFrame_m.h"
+#include "LoRaTDMAGWFrame.h"
 #include "inet/common/Protocol.h"
 #include "inet/queueing/contract/IActivePacketSink.h"
 #include "inet/queueing/contract/IPacketQueue.h"
@@ -40,6 +40,7 @@ class LoRaTDMAMac : public MacProtocolBase, public IMacProtocol, public queueing
     clocktime_t broadcastGuard;
     clocktime_t startTransmitOffset;
     clocktime_t firstRxSlot;
+    std::vector<Hz> channelFrequencies; // Channel plan, the beacon refers to it by index
     double bitrate = NaN;
     int headerLength = -1;
     // int sequenceNumber = 0;
@@ -48,8 +49,52 @@ class LoRaTDMAMac : public MacProtocolBase, public IMacProtocol, public queueing
     /** End of the Short Inter-Frame Time period */
     cMessage *endSifs = nullptr;
 
-    std::queue<int> nextTimeSlots;
+    std::queue<LoRaTDMATimeslot> nextTimeSlots;
+    std::queue<int> nextTimeSlotEntries; // Index of each of nextTimeSlots in the beacon's schedule
     clocktime_t lastRXendTime;
+    std::vector<clocktime_t> slotOffsets; // From the beacon, empty when every slot is txslotDuration long
+    clocktime_t uplinkLength;
+    MacAddress homeGateway; // Only set when several gateways share the network, beacons of others are ignored
+    int beaconPage = -1; // The page of a paged beacon that lists us, -1 until one did
+    clocktime_t listenDuration; // Of the next receive slot, all pages of the beacon while we look for ours
+    int pageSearchLimit; // Searches of all pages without finding ours before we back off to page 0
+    int pageSearchBackoffLimit; // Most doublings of that backoff
+    int pageSearchMisses = 0; // Searches of all pages in a row that did not find ours
+    int pageSearchBackoff = 0; // Beacon periods to listen to page 0 only before we search all pages again
+
+    /** @name Drift compensation */
+    //@{
+    bool driftCompensation; // Learn the clock drift from the beacons and correct for it
+    double driftEstimate; // ppm our clock gains on the gateway's
+    double driftResidual; // ppm still gained since the last beacon, despite the compensation
+    int numDriftEstimates;
+    clocktime_t lastSyncTime; // -1 before the first beacon
+    //@}
+
+    /** @name Over-the-air join */
+    //@{
+    bool overTheAirJoin;
+    bool synchronized; // Heard a beacon, so we know when the next one comes
+    bool joined; // The gateway has us in its schedule
+    bool joinPending; // The next transmit slot is for a join request
+    int joinBackoffLimit; // Most doublings of the backoff after unanswered join requests
+    int joinBackoff; // Beacons to let pass before the next join request
+    //@}
+    /** @name Acknowledgements */
+    //@{
+    struct PendingFrame {
+        Packet *frame;
+        int entry; // Index of the slot it was sent in, in that beacon's schedule
+        int retries;
+    };
+    int retryLimit;
+    int currentEntry; // Of the slot we transmit in next
+    std::vector<PendingFrame> sentFrames; // Sent since the last beacon, its acknowledgements are in the next one
+    std::deque<PendingFrame> retransmissions; // Missed by the gateway, they go before new frames
+    //@}
+    Hz currentTxFrequency;
+    int currentTxSpreadFactor;
+    bool enforceDutyCycle; // Skip slots while the sub-band has no airtime left
 
     /** @name MAC States */
     enum States {
@@ -87,6 +132,12 @@ class LoRaTDMAMac : public MacProtocolBase, public IMacProtocol, public queueing
     //@{
     long numSent;
     long numReceived;
+    long numJoinRequests;
+    long numSkippedDutyCycle; // Slots given up to keep to the duty cycle
+    long numAcknowledged;
+    long numRetransmissions;
+    long numDroppedRetryLimit;
+    simtime_t joinTime; // From powering on to being admitted, -1 until then
     //@}
 
   public:
@@ -97,6 +148,7 @@ class LoRaTDMAMac : public MacProtocolBase, public IMacProtocol, public queueing
     virtual ~LoRaTDMAMac();
     //@}
     virtual MacAddress getAddress();
+    virtual void setHomeGateway(const MacAddress& gatewayAddress, clocktime_t beaconPhaseOffset);
     virtual queueing::IPassivePacketSource *getProvider(cGate *gate) override;
     virtual void handleCanPullPacketChanged(cGate *gate) override;
     virtual void handlePullPacketProcessed(Packet *packet, cGate *gate, bool successful) override;
@@ -123,6 +175,13 @@ class LoRaTDMAMac : public MacProtocolBase, public IMacProtocol, public queueing
     // virtual void handleWithFsm(cMessage *msg);
     virtual void handleState(cMessage *msg);
     virtual void handleNextTXSlot();
+    virtual void synchronizeClock(clocktime_t syncTime);
+    virtual int getDriftClass() const;
+    virtual void scheduleJoinRequest(clocktime_t windowStart, clocktime_t windowLength);
+    virtual Packet *createJoinRequest();
+    virtual void handleAcknowledgements(const LoRaTDMAGWFrame *frame);
+    virtual void handleDownlinks(Packet *beacon, const LoRaTDMAGWFrame *frame);
+    virtual bool isListed(const LoRaTDMAGWFrame *frame) const;
 
     virtual void receiveSignal(cComponent *source, simsignal_t signalID, intval_t value, cObject *details) override;
 
@@ -0,0 +1,65 @@
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+// 
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see http://www.gnu.org/licenses/.
+// 
+
+
+
+#include "LoRaTDMASchedule.h"
+#include <algorithm>
+
+namespace flora_tdma {
+
+LoRaTDMASchedule::LoRaTDMASchedule(std::vector<LoRaTDMATimeslot> entries) :
+    entries(std::move(entries))
+{
+    // Give every node a row, in the order they first appear, and count its entries
+    std::vector<int> entryRows(this->entries.size());
+    std::vector<int> rowSizes;
+    for (size_t i = 0; i < this->entries.size(); i++) {
+        auto result = nodes.emplace(this->entries[i].address.getInt(), rowSizes.size());
+        if (result.second)
+            rowSizes.push_back(0);
+        entryRows[i] = result.first->second;
+        rowSizes[entryRows[i]]++;
+    }
+
+    // Then lay the rows out one after another and fill them
+    rowStarts.assign(rowSizes.size() + 1, 0);
+    for (size_t row = 0; row < rowSizes.size(); row++)
+        rowStarts[row + 1] = rowStarts[row] + rowSizes[row];
+    rowEntries.resize(this->entries.size());
+    std::vector<int> fill(rowStarts.begin(), rowStarts.end() - 1);
+    for (size_t i = 0; i < this->entries.size(); i++)
+        rowEntries[fill[entryRows[i]]++] = i;
+
+    // The schedule lists the entries channel by channel, a node needs its own in time order
+    for (size_t row = 0; row < rowSizes.size(); row++) {
+        std::stable_sort(rowEntries.begin() + rowStarts[row], rowEntries.begin() + rowStarts[row + 1], [this] (int a, int b) {
+            return this->entries[a].timeslot < this->entries[b].timeslot;
+        });
+    }
+}
+
+LoRaTDMASchedule::Entries LoRaTDMASchedule::findEntries(const MacAddress& address) const
+{
+    Entries result;
+    auto it = nodes.find(address.getInt());
+    if (it != nodes.end()) {
+        result.first = rowEntries.data() + rowStarts[it->second];
+        result.last = rowEntries.data() + rowStarts[it->second + 1];
+    }
+    return result;
+}
+
+}
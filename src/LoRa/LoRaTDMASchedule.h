@@ -0,0 +1,79 @@
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+// 
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see http://www.gnu.org/licenses/.
+// 
+
+
+
+#ifndef LORA_LORATDMASCHEDULE_H_
+#define LORA_LORATDMASCHEDULE_H_
+
+#include "inet/common/INETDefs.h"
+#include "inet/linklayer/common/MacAddress.h"
+#include "LoRaTDMAGWFrame_m.h"
+#include <memory>
+#include <unordered_map>
+#include <vector>
+
+namespace flora_tdma {
+
+using namespace inet;
+
+/**
+ * The schedule carried by one beacon.
+ *
+ * It is made once by the gateway and never changed afterwards, so every copy
+ * of the beacon the medium hands out shares the same schedule. Besides the
+ * entries in beacon order it keeps an index from each node to its entries,
+ * sorted by time slot, so a node finds its slots without going through the
+ * whole schedule.
+ */
+class LoRaTDMASchedule
+{
+  public:
+    /* Indices of one node's entries in the schedule */
+    struct Entries {
+        const int *first = nullptr;
+        const int *last = nullptr;
+
+        const int *begin() const { return first; }
+        const int *end() const { return last; }
+        size_t size() const { return last - first; }
+        bool empty() const { return first == last; }
+    };
+
+  protected:
+    std::vector<LoRaTDMATimeslot> entries; // Channel by channel, each in time order, or slot by slot with SF layers
+    std::unordered_map<uint64_t, int> nodes; // MAC address to its row of the index
+    std::vector<int> rowStarts; // Per row, where it starts in rowEntries, and one past the last row
+    std::vector<int> rowEntries; // Entry indices, row after row
+
+  public:
+    explicit LoRaTDMASchedule(std::vector<LoRaTDMATimeslot> entries);
+
+    /** The entries of the node in time slot order, none if the schedule does not list it. */
+    virtual Entries findEntries(const MacAddress& address) const;
+    virtual bool contains(const MacAddress& address) const { return nodes.count(address.getInt()) > 0; }
+
+    size_t size() const { return entries.size(); }
+    bool empty() const { return entries.empty(); }
+    const LoRaTDMATimeslot& operator[](size_t index) const { return entries[index]; }
+    std::vector<LoRaTDMATimeslot>::const_iterator begin() const { return entries.begin(); }
+    std::vector<LoRaTDMATimeslot>::const_iterator end() const { return entries.end(); }
+};
+
+typedef std::shared_ptr<const LoRaTDMASchedule> LoRaTDMASchedulePtr;
+
+}
+
+#endif /* LORA_LORATDMASCHEDULE_H_ */
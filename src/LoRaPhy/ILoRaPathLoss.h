@@ -0,0 +1,50 @@
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+// 
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see http://www.gnu.org/licenses/.
+// 
+
+
+
+#ifndef LORAPHY_ILORAPATHLOSS_H_
+#define LORAPHY_ILORAPATHLOSS_H_
+
+#include "inet/common/INETDefs.h"
+#include "inet/common/Units.h"
+#include "LoRaShadowingMap.h"
+
+namespace flora_tdma {
+
+using namespace inet;
+using namespace inet::units::values;
+
+/**
+ * A LoRa path loss model that is a deterministic mean loss with log-normal
+ * shadowing around it, so that the two parts can be used on their own.
+ * The shadowing is drawn per packet, or taken from a LoRaShadowingMap.
+ */
+class ILoRaPathLoss
+{
+  public:
+    virtual ~ILoRaPathLoss() {}
+
+    /** The path loss as a fraction, without the shadowing. */
+    virtual double computeMeanPathLoss(m distance) const = 0;
+    /** Standard deviation of the shadowing in dB. */
+    virtual double getShadowingSigma() const = 0;
+    /** The spatially correlated shadowing, nullptr if the model draws it independently per packet. */
+    virtual const LoRaShadowingMap *getShadowingMap() const = 0;
+};
+
+}
+
+#endif /* LORAPHY_ILORAPATHLOSS_H_ */
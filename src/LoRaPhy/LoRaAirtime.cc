@@ -0,0 +1,65 @@
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+// 
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see http://www.gnu.org/licenses/.
+// 
+
+
+
+#include "LoRaAirtime.h"
+#include <unordered_map>
+
+namespace flora_tdma {
+
+int LoRaAirtime::getPayloadSymbols(int spreadFactor, Hz bandwidth, int codeRendundance, int payloadBytes, bool explicitHeader)
+{
+    if (spreadFactor < 6 || spreadFactor > 12)
+        throw cRuntimeError("Invalid spreading factor: %d", spreadFactor);
+    if (codeRendundance < 1 || codeRendundance > 4)
+        throw cRuntimeError("Invalid code rate: 4/%d", codeRendundance + 4);
+    if (payloadBytes < 0)
+        throw cRuntimeError("Invalid payload length: %d bytes", payloadBytes);
+
+    // All in integers, so the division rounds up exactly
+    int lowDataRate = isLowDataRateOptimized(spreadFactor, bandwidth) ? 1 : 0;
+    int numerator = 8 * payloadBytes - 4 * spreadFactor + 28 + 16 - (explicitHeader ? 0 : 20);
+    int denominator = 4 * (spreadFactor - 2 * lowDataRate);
+    int blocks = numerator > 0 ? (numerator + denominator - 1) / denominator : 0;
+    return 8 + blocks * (codeRendundance + 4);
+}
+
+LoRaAirtime::Airtime LoRaAirtime::computeAirtime(int spreadFactor, Hz bandwidth, int codeRendundance, int payloadBytes, bool explicitHeader)
+{
+    // Packed (SF, BW, CR, header, length). Longer frames than the key holds, and bandwidths that are not
+    // a whole number of Hz, are computed every time, so two bandwidths never share an entry
+    static std::unordered_map<uint64_t, Airtime> airtimes;
+    bool cacheable = payloadBytes >= 0 && payloadBytes <= 0xFFFF && bandwidth.get() >= 0 && bandwidth.get() < 4294967296.0 && bandwidth.get() == std::floor(bandwidth.get()) && codeRendundance >= 0 && codeRendundance <= 0xF && spreadFactor >= 0 && spreadFactor <= 0xF;
+    uint64_t key = 0;
+    if (cacheable) {
+        key = ((uint64_t)bandwidth.get() << 32) | ((uint64_t)spreadFactor << 24) | ((uint64_t)codeRendundance << 20) | ((uint64_t)explicitHeader << 16) | (uint64_t)payloadBytes;
+        auto it = airtimes.find(key);
+        if (it != airtimes.end())
+            return it->second;
+    }
+
+    simtime_t symbolTime = getSymbolTime(spreadFactor, bandwidth);
+    int payloadSymbols = getPayloadSymbols(spreadFactor, bandwidth, codeRendundance, payloadBytes, explicitHeader);
+    Airtime airtime;
+    airtime.preamble = (PREAMBLE_SYMBOLS + 4.25) * symbolTime;
+    airtime.header = 8 * symbolTime;
+    airtime.payload = (payloadSymbols - 8) * symbolTime;
+    if (cacheable)
+        airtimes[key] = airtime;
+    return airtime;
+}
+
+}
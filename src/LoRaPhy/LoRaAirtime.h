@@ -0,0 +1,68 @@
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+// 
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see http://www.gnu.org/licenses/.
+// 
+
+
+
+#ifndef LORAPHY_LORAAIRTIME_H_
+#define LORAPHY_LORAAIRTIME_H_
+
+#include "inet/common/INETDefs.h"
+#include "inet/common/Units.h"
+#include <cmath>
+
+namespace flora_tdma {
+
+using namespace inet;
+using namespace inet::units::values;
+
+/**
+ * Time on air of a LoRa frame, after the Semtech SX127x datasheet (AN1200.13):
+ *
+ *   Tsym = 2^SF / BW
+ *   Tpreamble = (nPreamble + 4.25) * Tsym
+ *   payloadSymbNb = 8 + max(ceil((8PL - 4SF + 28 + 16CRC - 20IH) / (4(SF - 2DE))) * (CR + 4), 0)
+ *
+ * with low data rate optimisation (DE) whenever a symbol lasts 16 ms or more,
+ * as the radio requires it then. The CRC is always on. The radio, both MACs and
+ * the slot sizing all go through here, so they agree on every duration.
+ *
+ * Results are kept per (SF, BW, CR, header, length): a simulation only ever
+ * sees a handful of these, so after the first frame of a kind it is a lookup.
+ */
+class LoRaAirtime
+{
+  public:
+    /* A frame is sent as its preamble, then the first 8 symbols that carry the
+     * explicit header (always at CR 4/8), then the rest of the payload */
+    struct Airtime {
+        simtime_t preamble;
+        simtime_t header;
+        simtime_t payload;
+
+        simtime_t getTotal() const { return preamble + header + payload; }
+    };
+
+    static constexpr int PREAMBLE_SYMBOLS = 8;
+
+    static Airtime computeAirtime(int spreadFactor, Hz bandwidth, int codeRendundance, int payloadBytes, bool explicitHeader = true);
+    static simtime_t getAirtime(int spreadFactor, Hz bandwidth, int codeRendundance, int payloadBytes, bool explicitHeader = true) { return computeAirtime(spreadFactor, bandwidth, codeRendundance, payloadBytes, explicitHeader).getTotal(); }
+    static simtime_t getSymbolTime(int spreadFactor, Hz bandwidth) { return std::ldexp(1.0, spreadFactor) / bandwidth.get(); }
+    static bool isLowDataRateOptimized(int spreadFactor, Hz bandwidth) { return std::ldexp(1.0, spreadFactor) / bandwidth.get() >= 16e-3; }
+    static int getPayloadSymbols(int spreadFactor, Hz bandwidth, int codeRendundance, int payloadBytes, bool explicitHeader = true);
+};
+
+}
+
+#endif /* LORAPHY_LORAAIRTIME_H_ */
@@ -20,12 +20,57 @@
 #include "LoRaReception.h"
 #include "LoRaTransmission.h"
 #include "LoRaReceiver.h"
+#include "LoRaMedium.h"
 #include "LoRa/LoRaRadio.h"
+#include <algorithm>
 
 namespace flora_tdma {
 
 Define_Module(LoRaAnalogModel);
 
+void LoRaAnalogModel::initialize(int stage)
+{
+    ScalarAnalogModelBase::initialize(stage);
+    if (stage == INITSTAGE_LOCAL) {
+        useLinkBudgetTable = par("linkBudgetTable");
+        bool pathLossShadowingMap = useLinkBudgetTable && getParentModule()->getSubmodule("pathLoss")->hasPar("shadowingMap") && getParentModule()->getSubmodule("pathLoss")->par("shadowingMap").boolValue();
+        const char *linkShadowingString = par("linkShadowing");
+        if (!strcmp(linkShadowingString, ""))
+            linkShadowing = pathLossShadowingMap ? SHADOWING_MAP : SHADOWING_PER_PACKET; // The same shadowing as without the table
+        else if (!strcmp(linkShadowingString, "none"))
+            linkShadowing = SHADOWING_NONE;
+        else if (!strcmp(linkShadowingString, "static"))
+            linkShadowing = SHADOWING_STATIC;
+        else if (!strcmp(linkShadowingString, "packet"))
+            linkShadowing = SHADOWING_PER_PACKET;
+        else if (!strcmp(linkShadowingString, "map"))
+            linkShadowing = SHADOWING_MAP;
+        else
+            throw cRuntimeError("Unknown linkShadowing: %s", linkShadowingString);
+        linkBudgetFile = par("linkBudgetFile").stdstringValue();
+        if (useLinkBudgetTable) {
+            loRaPathLoss = dynamic_cast<const ILoRaPathLoss *>(getParentModule()->getSubmodule("pathLoss"));
+            if (loRaPathLoss == nullptr)
+                throw cRuntimeError("The link budget table needs LoRaLogNormalShadowing or LoRaPathLossOulu as path loss");
+            if (linkShadowing == SHADOWING_MAP && !pathLossShadowingMap)
+                throw cRuntimeError("linkShadowing = \"map\" needs shadowingMap = true on the path loss");
+            if ((linkShadowing == SHADOWING_STATIC || linkShadowing == SHADOWING_PER_PACKET) && pathLossShadowingMap)
+                throw cRuntimeError("linkShadowing = \"%s\" does not match shadowingMap = true on the path loss, use \"map\"", linkShadowingString);
+        }
+        // Only drawn when it is used, so the RNG stream of every other configuration stays as it was
+        if (useLinkBudgetTable && (linkShadowing == SHADOWING_STATIC || linkShadowing == SHADOWING_PER_PACKET))
+            shadowingSeed = ((uint64_t)getRNG(0)->intRand() << 32) | getRNG(0)->intRand();
+    }
+}
+
+void LoRaAnalogModel::finish()
+{
+    if (useLinkBudgetTable) {
+        recordScalar("numLinkBudgetLookups", numLinkBudgetLookups);
+        recordScalar("numLinkBudgetComputations", numLinkBudgetComputations);
+    }
+}
+
 std::ostream& LoRaAnalogModel::printToStream(std::ostream& stream, int level, int evFlags) const
 {
     return stream << "LoRaAnalogModel";
@@ -82,17 +127,85 @@ const W LoRaAnalogModel::getBackgroundNoisePower(const LoRaBandListening *listen
 }
 
 W LoRaAnalogModel::computeReceptionPower(const IRadio *receiverRadio, const ITransmission *transmission, const IArrival *arrival) const
+{
+    const IScalarSignal *scalarSignalAnalogModel = check_and_cast<const IScalarSignal *>(transmission->getAnalogModel());
+    W transmissionPower = scalarSignalAnalogModel->getPower();
+    double gain = useLinkBudgetTable ? lookupLinkGain(receiverRadio, transmission, arrival) : NaN;
+    if (std::isnan(gain))
+        gain = computeLinkGain(receiverRadio, transmission, arrival, false);
+    return transmissionPower * std::min(1.0, gain);
+}
+
+double LoRaAnalogModel::computeLinkGain(const IRadio *receiverRadio, const ITransmission *transmission, const IArrival *arrival, bool meanPathLoss) const
 {
     const IRadioMedium *radioMedium = receiverRadio->getMedium();
     const INarrowbandSignal *narrowbandSignalAnalogModel = check_and_cast<const INarrowbandSignal *>(transmission->getAnalogModel());
-    const IScalarSignal *scalarSignalAnalogModel = check_and_cast<const IScalarSignal *>(transmission->getAnalogModel());
     const Coord receptionStartPosition = arrival->getStartPosition();
     double transmitterAntennaGain = computeAntennaGain(transmission->getTransmitterAntennaGain(), transmission->getStartPosition(), arrival->getStartPosition(), transmission->getStartOrientation());
     double receiverAntennaGain = computeAntennaGain(receiverRadio->getAntenna()->getGain().get(), arrival->getStartPosition(), transmission->getStartPosition(), arrival->getStartOrientation());
-    double pathLoss = radioMedium->getPathLoss()->computePathLoss(transmission, arrival);
+    double pathLoss = meanPathLoss ? loRaPathLoss->computeMeanPathLoss(m(transmission->getStartPosition().distance(receptionStartPosition))) : radioMedium->getPathLoss()->computePathLoss(transmission, arrival);
     double obstacleLoss = radioMedium->getObstacleLoss() ? radioMedium->getObstacleLoss()->computeObstacleLoss(narrowbandSignalAnalogModel->getCenterFrequency(), transmission->getStartPosition(), receptionStartPosition) : 1;
-    W transmissionPower = scalarSignalAnalogModel->getPower();
-    return transmissionPower * std::min(1.0, transmitterAntennaGain * receiverAntennaGain * pathLoss * obstacleLoss);
+    return transmitterAntennaGain * receiverAntennaGain * pathLoss * obstacleLoss;
+}
+
+void LoRaAnalogModel::openLinkBudgetTable(const LoRaMedium *medium) const
+{
+    // The fingerprint covers everything the mean gains depend on, a file of another topology or model is started over
+    int numRadios = medium->getNumIndexedRadios();
+    uint64_t fingerprint = LoRaLinkBudgetTable::mix((uint64_t)0, (uint64_t)numRadios);
+    stationaryRadios.assign(numRadios, false);
+    for (int i = 0; i < numRadios; i++) {
+        const IRadio *radio = medium->getIndexedRadio(i);
+        if (radio == nullptr)
+            continue;
+        const IMobility *mobility = radio->getAntenna()->getMobility();
+        Coord position = mobility->getCurrentPosition();
+        stationaryRadios[i] = mobility->getMaxSpeed() == 0;
+        fingerprint = LoRaLinkBudgetTable::mix(fingerprint, position.x);
+        fingerprint = LoRaLinkBudgetTable::mix(fingerprint, position.y);
+        fingerprint = LoRaLinkBudgetTable::mix(fingerprint, position.z);
+        fingerprint = LoRaLinkBudgetTable::mix(fingerprint, radio->getAntenna()->getGain()->getMaxGain());
+        fingerprint = LoRaLinkBudgetTable::mix(fingerprint, (uint64_t)stationaryRadios[i]);
+    }
+    fingerprint = LoRaLinkBudgetTable::mix(fingerprint, loRaPathLoss->computeMeanPathLoss(m(100)));
+    fingerprint = LoRaLinkBudgetTable::mix(fingerprint, loRaPathLoss->computeMeanPathLoss(m(10000)));
+    fingerprint = LoRaLinkBudgetTable::mix(fingerprint, (uint64_t)(medium->getObstacleLoss() != nullptr));
+    long numFilled = linkBudgetTable.open(numRadios, fingerprint, linkBudgetFile.c_str());
+    EV_DETAIL << "Link budget table for " << numRadios << " radios, " << numFilled << " links known from an earlier run" << endl;
+}
+
+double LoRaAnalogModel::lookupLinkGain(const IRadio *receiverRadio, const ITransmission *transmission, const IArrival *arrival) const
+{
+    const LoRaMedium *medium = check_and_cast<const LoRaMedium *>(receiverRadio->getMedium());
+    if (!linkBudgetTable.isOpen())
+        openLinkBudgetTable(medium);
+    int transmitterIndex = medium->getRadioIndex(transmission->getTransmitterRadioId());
+    int receiverIndex = medium->getRadioIndex(receiverRadio->getId());
+    // Radios that registered after the table was made, and radios that move, are computed as before
+    int numRadios = linkBudgetTable.getNumRadios();
+    if (transmitterIndex < 0 || transmitterIndex >= numRadios || receiverIndex < 0 || receiverIndex >= numRadios
+            || !stationaryRadios[transmitterIndex] || !stationaryRadios[receiverIndex])
+        return NaN;
+
+    numLinkBudgetLookups++;
+    float& meanGain = linkBudgetTable.at(transmitterIndex, receiverIndex);
+    if (std::isnan(meanGain)) {
+        meanGain = math::fraction2dB(computeLinkGain(receiverRadio, transmission, arrival, true));
+        numLinkBudgetComputations++;
+    }
+
+    double shadowing = 0; // dB
+    if (linkShadowing == SHADOWING_STATIC) {
+        uint64_t key = LoRaLinkBudgetTable::mix(shadowingSeed, (uint64_t)std::min(transmitterIndex, receiverIndex));
+        shadowing = loRaPathLoss->getShadowingSigma() * LoRaLinkBudgetTable::gaussian(LoRaLinkBudgetTable::mix(key, (uint64_t)std::max(transmitterIndex, receiverIndex)));
+    }
+    else if (linkShadowing == SHADOWING_PER_PACKET) {
+        uint64_t key = LoRaLinkBudgetTable::mix(shadowingSeed, (uint64_t)transmission->getId());
+        shadowing = loRaPathLoss->getShadowingSigma() * LoRaLinkBudgetTable::gaussian(LoRaLinkBudgetTable::mix(key, (uint64_t)receiverIndex));
+    }
+    else if (linkShadowing == SHADOWING_MAP)
+        shadowing = loRaPathLoss->getShadowingMap()->getShadowing(transmission->getStartPosition(), arrival->getStartPosition());
+    return math::dB2fraction(meanGain - shadowing);
 }
 
 const IReception *LoRaAnalogModel::computeReception(const IRadio *receiverRadio, const ITransmission *transmission, const IArrival *arrival) const
@@ -112,14 +225,13 @@ const IReception *LoRaAnalogModel::computeReception(const IRadio *receiverRadio,
     return new LoRaReception(receiverRadio, transmission, receptionStartTime, receptionEndTime, receptionStartPosition, receptionEndPosition, receptionStartOrientation, receptionEndOrientation, LoRaCF, LoRaBW, receivedPower, LoRaSF, LoRaCR);
 }
 
-const INoise *LoRaAnalogModel::computeNoise(const IListening *listening, const IInterference *interference) const
+void LoRaAnalogModel::collectPowerChanges(const LoRaBandListening *bandListening, const IInterference *interference, simtime_t& noiseStartTime, simtime_t& noiseEndTime) const
 {
-    const LoRaBandListening *bandListening = check_and_cast<const LoRaBandListening *>(listening);
     Hz commonCarrierFrequency = bandListening->getLoRaCF();
     Hz commonBandwidth = bandListening->getLoRaBW();
-    simtime_t noiseStartTime = SimTime::getMaxTime();
-    simtime_t noiseEndTime = 0;
-    std::map<simtime_t, W> *powerChanges = new std::map<simtime_t, W>();
+    noiseStartTime = SimTime::getMaxTime();
+    noiseEndTime = 0;
+    powerChanges.clear();
     const std::vector<const IReception *> *interferingReceptions = interference->getInterferingReceptions();
     for (auto reception : *interferingReceptions) {
         const ISignalAnalogModel *signalAnalogModel = reception->getAnalogModel();
@@ -129,52 +241,69 @@ const INoise *LoRaAnalogModel::computeNoise(const IListening *listening, const I
         Hz signalBandwidth = loRaReception->getLoRaBW();
         if((commonCarrierFrequency == signalCarrierFrequency && commonBandwidth == signalBandwidth))
         {
-            const IScalarSignal *scalarSignalAnalogModel = check_and_cast<const IScalarSignal *>(signalAnalogModel);
-            W power = scalarSignalAnalogModel->getPower();
+            W power = loRaReception->getPower();
             simtime_t startTime = reception->getStartTime();
             simtime_t endTime = reception->getEndTime();
             if (startTime < noiseStartTime)
                 noiseStartTime = startTime;
             if (endTime > noiseEndTime)
                 noiseEndTime = endTime;
-            std::map<simtime_t, W>::iterator itStartTime = powerChanges->find(startTime);
-            if (itStartTime != powerChanges->end())
-                itStartTime->second += power;
-            else
-                powerChanges->insert(std::pair<simtime_t, W>(startTime, power));
-            std::map<simtime_t, W>::iterator itEndTime = powerChanges->find(endTime);
-            if (itEndTime != powerChanges->end())
-                itEndTime->second -= power;
-            else
-                powerChanges->insert(std::pair<simtime_t, W>(endTime, -power));
+            powerChanges.push_back(std::make_pair(startTime, power));
+            powerChanges.push_back(std::make_pair(endTime, -power));
         }
         else if (areOverlappingBands(commonCarrierFrequency, commonBandwidth, narrowbandSignalAnalogModel->getCenterFrequency(), narrowbandSignalAnalogModel->getBandwidth()))
             throw cRuntimeError("Overlapping bands are not supported");
     }
 
-    simtime_t startTime = listening->getStartTime();
-    simtime_t endTime = listening->getEndTime();
-    std::map<simtime_t, W> *backgroundNoisePowerChanges = new std::map<simtime_t, W>();
     const W noisePower = getBackgroundNoisePower(bandListening);
-    backgroundNoisePowerChanges->insert(std::pair<simtime_t, W>(startTime, noisePower));
-    backgroundNoisePowerChanges->insert(std::pair<simtime_t, W>(endTime, -noisePower));
+    powerChanges.push_back(std::make_pair(bandListening->getStartTime(), noisePower));
+    powerChanges.push_back(std::make_pair(bandListening->getEndTime(), -noisePower));
 
-    for (const auto & backgroundNoisePowerChange : *backgroundNoisePowerChanges) {
-        std::map<simtime_t, W>::iterator jt = powerChanges->find(backgroundNoisePowerChange.first);
-        if (jt != powerChanges->end())
-            jt->second += backgroundNoisePowerChange.second;
+    // Sort by time and add up the changes that happen at the same instant
+    std::sort(powerChanges.begin(), powerChanges.end(), [] (const std::pair<simtime_t, W>& a, const std::pair<simtime_t, W>& b) {
+        return a.first < b.first;
+    });
+    size_t last = 0;
+    for (size_t i = 1; i < powerChanges.size(); i++) {
+        if (powerChanges[i].first == powerChanges[last].first)
+            powerChanges[last].second += powerChanges[i].second;
         else
-            powerChanges->insert(std::pair<simtime_t, W>(backgroundNoisePowerChange.first, backgroundNoisePowerChange.second));
+            powerChanges[++last] = powerChanges[i];
     }
+    powerChanges.resize(last + 1);
+}
+
+const INoise *LoRaAnalogModel::computeNoise(const IListening *listening, const IInterference *interference) const
+{
+    const LoRaBandListening *bandListening = check_and_cast<const LoRaBandListening *>(listening);
+    simtime_t noiseStartTime, noiseEndTime;
+    collectPowerChanges(bandListening, interference, noiseStartTime, noiseEndTime);
+
+    // ScalarNoise takes a map and owns it. The changes are sorted already, so every insert goes at the end
+    std::map<simtime_t, W> *noisePowerChanges = new std::map<simtime_t, W>();
+    for (const auto& powerChange : powerChanges)
+        noisePowerChanges->emplace_hint(noisePowerChanges->end(), powerChange);
+    return new ScalarNoise(noiseStartTime, noiseEndTime, bandListening->getLoRaCF(), bandListening->getLoRaBW(), noisePowerChanges);
+}
+
+W LoRaAnalogModel::computeNoisePower(const IListening *listening, const IInterference *interference, simtime_t startTime, simtime_t endTime, bool maximum) const
+{
+    const LoRaBandListening *bandListening = check_and_cast<const LoRaBandListening *>(listening);
+    simtime_t noiseStartTime, noiseEndTime;
+    collectPowerChanges(bandListening, interference, noiseStartTime, noiseEndTime);
 
-    EV_TRACE << "Noise power begin " << endl;
-    W noise = W(0);
-    for (std::map<simtime_t, W>::const_iterator it = powerChanges->begin(); it != powerChanges->end(); it++) {
-        noise += it->second;
-        EV_TRACE << "Noise at " << it->first << " = " << noise << endl;
+    // Walk the changes as ScalarNoise does, the level after each change in [startTime, endTime) counts
+    W noisePower = W(0);
+    W result = W(NaN);
+    for (const auto& powerChange : powerChanges) {
+        noisePower += powerChange.second;
+        if (powerChange.first >= endTime)
+            break;
+        if (powerChange.first >= startTime && (std::isnan(result.get()) || (maximum ? noisePower > result : noisePower < result)))
+            result = noisePower;
     }
-    EV_TRACE << "Noise power end" << endl;
-    return new ScalarNoise(noiseStartTime, noiseEndTime, commonCarrierFrequency, commonBandwidth, powerChanges);
+    EV_TRACE << "Noise power " << (maximum ? "maximum" : "minimum") << " between " << startTime << " and " << endTime << " = " << result << endl;
+    return result;
 }
 
 const ISnir *LoRaAnalogModel::computeSNIR(const IReception *reception, const INoise *noise) const
@@ -21,17 +21,63 @@
 #include "inet/physicallayer/wireless/common/analogmodel/packetlevel/ScalarNoise.h"
 
 #include "LoRaBandListening.h"
+#include "LoRaLinkBudgetTable.h"
+#include "ILoRaPathLoss.h"
 
 namespace flora_tdma {
 
+class LoRaMedium;
+
 class LoRaAnalogModel : public ScalarAnalogModelBase
 {
+  protected:
+    /** @name Link budget table */
+    //@{
+    enum LinkShadowing {
+      SHADOWING_NONE,       // the mean path loss only
+      SHADOWING_STATIC,     // one draw per link for the whole run, the same in both directions
+      SHADOWING_PER_PACKET, // a new draw for every reception, like the path loss models do
+      SHADOWING_MAP,        // the spatially correlated shadowing map of the path loss model
+    };
+    bool useLinkBudgetTable;
+    LinkShadowing linkShadowing;
+    std::string linkBudgetFile;
+    const ILoRaPathLoss *loRaPathLoss = nullptr;
+    uint64_t shadowingSeed = 0; // Taken from the module's RNG, so the shadowing follows the seed of the run
+    mutable LoRaLinkBudgetTable linkBudgetTable; // Opened on the first reception, when all radios have registered
+    mutable std::vector<bool> stationaryRadios; // By radio index, only links between these are in the table
+    mutable long numLinkBudgetLookups = 0;
+    mutable long numLinkBudgetComputations = 0;
+
+    virtual void openLinkBudgetTable(const LoRaMedium *medium) const;
+    /* Gain of the link including the shadowing, NaN if the table does not hold the link */
+    virtual double lookupLinkGain(const IRadio *receiverRadio, const ITransmission *transmission, const IArrival *arrival) const;
+    /* Antenna gains, path loss and obstacle loss, with the mean path loss or one with shadowing */
+    virtual double computeLinkGain(const IRadio *receiverRadio, const ITransmission *transmission, const IArrival *arrival, bool meanPathLoss) const;
+    //@}
+
+    /* Noise power changes of the listening's band, sorted by time with one entry per instant.
+     * The buffer is kept between calls, so after the first few it never allocates */
+    mutable std::vector<std::pair<simtime_t, W>> powerChanges;
+
+    /* Fills powerChanges with the interferers on the listening's band and the background noise.
+     * noiseStartTime and noiseEndTime span the interferers, as ScalarNoise expects them */
+    virtual void collectPowerChanges(const LoRaBandListening *listening, const IInterference *interference, simtime_t& noiseStartTime, simtime_t& noiseEndTime) const;
+    virtual W computeNoisePower(const IListening *listening, const IInterference *interference, simtime_t startTime, simtime_t endTime, bool maximum) const;
+
+    virtual void initialize(int stage) override;
+    virtual void finish() override;
+
   public:
     const W getBackgroundNoisePower(const LoRaBandListening *listening) const;
     virtual std::ostream& printToStream(std::ostream& stream, int level, int evFlags = 0) const override;
     virtual W computeReceptionPower(const IRadio *radio, const ITransmission *transmission, const IArrival *arrival) const override;
     virtual const IReception *computeReception(const IRadio *radio, const ITransmission *transmission, const IArrival *arrival) const override;
     const INoise *computeNoise(const IListening *listening, const IInterference *interference) const override;
+
+    /** The same as ScalarNoise::computeMaxPower() and computeMinPower() on computeNoise(), without building the noise. */
+    virtual W computeMaxNoisePower(const IListening *listening, const IInterference *interference, simtime_t startTime, simtime_t endTime) const { return computeNoisePower(listening, interference, startTime, endTime, true); }
+    virtual W computeMinNoisePower(const IListening *listening, const IInterference *interference, simtime_t startTime, simtime_t endTime) const { return computeNoisePower(listening, interference, startTime, endTime, false); }
     virtual const ISnir *computeSNIR(const IReception *reception, const INoise *noise) const override;
 };
 
@@ -0,0 +1,157 @@
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+// 
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see http://www.gnu.org/licenses/.
+// 
+
+
+
+#include "LoRaLinkBudgetTable.h"
+#include <algorithm>
+#include <cerrno>
+#include <cmath>
+#include <cstring>
+#include <limits>
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+namespace flora_tdma {
+
+static const char LINK_BUDGET_MAGIC[8] = { 'L', 'o', 'R', 'a', 'L', 'B', 'T', '\0' };
+static const uint32_t LINK_BUDGET_VERSION = 1;
+
+long LoRaLinkBudgetTable::open(int numRadios, uint64_t fingerprint, const char *fileName)
+{
+    close();
+    this->numRadios = numRadios;
+    this->fileName = fileName;
+    size_t numEntries = (size_t)numRadios * numRadios;
+    Header header;
+    memcpy(header.magic, LINK_BUDGET_MAGIC, sizeof(header.magic));
+    header.version = LINK_BUDGET_VERSION;
+    header.numRadios = numRadios;
+    header.fingerprint = fingerprint;
+
+    if (this->fileName.empty()) {
+        memory.assign(numEntries, std::numeric_limits<float>::quiet_NaN());
+        gains = memory.data();
+        return 0;
+    }
+
+#ifdef _WIN32
+    throw cRuntimeError("A link budget file needs memory-mapped files, which are not supported on this platform");
+#else
+    // A file is never resized or rewritten in place, other runs may have it mapped and would get SIGBUS.
+    // A file that does not match is replaced by a new one, made under a temporary name and renamed over it.
+    mappingSize = sizeof(Header) + numEntries * sizeof(float);
+    int fd = ::open(fileName, O_RDWR);
+    bool valid = false;
+    if (fd >= 0) {
+        Header existing;
+        valid = ::pread(fd, &existing, sizeof(existing), 0) == (ssize_t)sizeof(existing)
+                && memcmp(&existing, &header, sizeof(header)) == 0
+                && lseek(fd, 0, SEEK_END) == (off_t)mappingSize;
+        if (!valid) {
+            ::close(fd);
+            fd = -1;
+        }
+    }
+    else if (errno != ENOENT)
+        throw cRuntimeError("Cannot open link budget file %s: %s", fileName, strerror(errno));
+
+    std::string tempFileName;
+    if (!valid) {
+        tempFileName = this->fileName + ".XXXXXX";
+        fd = mkstemp(&tempFileName[0]);
+        if (fd < 0)
+            throw cRuntimeError("Cannot create link budget file %s: %s", tempFileName.c_str(), strerror(errno));
+        if (::fchmod(fd, 0644) != 0 || ::ftruncate(fd, mappingSize) != 0) {
+            int error = errno;
+            ::close(fd);
+            ::unlink(tempFileName.c_str());
+            throw cRuntimeError("Cannot resize link budget file %s: %s", tempFileName.c_str(), strerror(error));
+        }
+    }
+    mapping = mmap(nullptr, mappingSize, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    int error = errno;
+    ::close(fd);
+    if (mapping == MAP_FAILED) {
+        mapping = nullptr;
+        if (!valid)
+            ::unlink(tempFileName.c_str());
+        throw cRuntimeError("Cannot map link budget file %s: %s", fileName, strerror(error));
+    }
+    gains = reinterpret_cast<float *>(static_cast<char *>(mapping) + sizeof(Header));
+
+    long numFilled = 0;
+    if (valid) {
+        for (size_t i = 0; i < numEntries; i++)
+            numFilled += !std::isnan(gains[i]);
+    }
+    else {
+        // A new file reads as zeros, which would be a gain of 0 dB
+        std::fill(gains, gains + numEntries, std::numeric_limits<float>::quiet_NaN());
+        memcpy(mapping, &header, sizeof(header));
+        if (::rename(tempFileName.c_str(), fileName) != 0) {
+            error = errno;
+            ::unlink(tempFileName.c_str());
+            close();
+            throw cRuntimeError("Cannot replace link budget file %s: %s", fileName, strerror(error));
+        }
+    }
+    return numFilled;
+#endif
+}
+
+void LoRaLinkBudgetTable::close()
+{
+#ifndef _WIN32
+    if (mapping != nullptr)
+        munmap(mapping, mappingSize);
+#endif
+    mapping = nullptr;
+    mappingSize = 0;
+    memory.clear();
+    gains = nullptr;
+    numRadios = 0;
+}
+
+uint64_t LoRaLinkBudgetTable::mix(uint64_t hash, uint64_t value)
+{
+    // splitmix64 finalizer over the combined value
+    uint64_t z = hash ^ (value + 0x9e3779b97f4a7c15ULL + (hash << 6) + (hash >> 2));
+    z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+    return z ^ (z >> 31);
+}
+
+uint64_t LoRaLinkBudgetTable::mix(uint64_t hash, double value)
+{
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+    return mix(hash, bits);
+}
+
+double LoRaLinkBudgetTable::gaussian(uint64_t key)
+{
+    // Box-Muller on two uniforms taken from one 64 bit hash of the key
+    uint64_t bits = mix(key, (uint64_t)0);
+    double u1 = ((bits >> 32) + 1.0) / 4294967297.0; // (0, 1), so the logarithm is finite
+    double u2 = (bits & 0xffffffffULL) / 4294967296.0;
+    return std::sqrt(-2 * std::log(u1)) * std::cos(2 * M_PI * u2);
+}
+
+}
@@ -0,0 +1,80 @@
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+// 
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see http://www.gnu.org/licenses/.
+// 
+
+
+
+#ifndef LORAPHY_LORALINKBUDGETTABLE_H_
+#define LORAPHY_LORALINKBUDGETTABLE_H_
+
+#include "inet/common/INETDefs.h"
+#include <string>
+#include <vector>
+
+namespace flora_tdma {
+
+using namespace inet;
+
+/**
+ * Mean gain of every link between a fixed set of radios, in dB, for a
+ * transmitter row and a receiver column.
+ *
+ * An entry is NaN until it is filled in. With a file name the table is a
+ * memory-mapped file: what one run fills in, the next run of the same
+ * topology finds there. The file starts with a fingerprint of the topology
+ * and the models. A file with another fingerprint is replaced by a new
+ * one through a rename, never truncated, so runs that still have the old
+ * file mapped are not affected.
+ */
+class LoRaLinkBudgetTable
+{
+  protected:
+    struct Header {
+        char magic[8];
+        uint32_t version;
+        uint32_t numRadios;
+        uint64_t fingerprint;
+    };
+
+    int numRadios = 0;
+    float *gains = nullptr;
+    std::vector<float> memory; // Without a file
+    std::string fileName;
+    void *mapping = nullptr;
+    size_t mappingSize = 0;
+
+  public:
+    LoRaLinkBudgetTable() {}
+    virtual ~LoRaLinkBudgetTable() { close(); }
+    LoRaLinkBudgetTable(const LoRaLinkBudgetTable&) = delete;
+    LoRaLinkBudgetTable& operator=(const LoRaLinkBudgetTable&) = delete;
+
+    /** Returns the number of entries already filled in, from an earlier run. */
+    virtual long open(int numRadios, uint64_t fingerprint, const char *fileName);
+    virtual void close();
+    bool isOpen() const { return gains != nullptr; }
+    int getNumRadios() const { return numRadios; }
+
+    float& at(int transmitterIndex, int receiverIndex) { return gains[(size_t)transmitterIndex * numRadios + receiverIndex]; }
+
+    /** Fingerprints are built by mixing values into a hash. */
+    static uint64_t mix(uint64_t hash, uint64_t value);
+    static uint64_t mix(uint64_t hash, double value);
+    /** A standard normal value determined by the key, the same key gives the same value. */
+    static double gaussian(uint64_t key);
+};
+
+}
+
+#endif /* LORAPHY_LORALINKBUDGETTABLE_H_ */
@@ -29,6 +29,9 @@ void LoRaLogNormalShadowing::initialize(int stage)
     FreeSpacePathLoss::initialize(stage);
     if (stage == INITSTAGE_LOCAL) {
         sigma = par("sigma");
+        useShadowingMap = par("shadowingMap");
+        shadowingMapResolution = m(par("shadowingMapResolution")).get();
+        decorrelationDistance = m(par("decorrelationDistance")).get();
         gamma = par("gamma");
         d0 = m(par("d0"));
     }
@@ -44,11 +47,36 @@ std::ostream& LoRaLogNormalShadowing::printToStream(std::ostream& stream, int le
     return stream;
 }
 
+double LoRaLogNormalShadowing::computePathLoss(const ITransmission *transmission, const IArrival *arrival) const
+{
+    if (!useShadowingMap)
+        return FreeSpacePathLoss::computePathLoss(transmission, arrival);
+    // The shadowing of the place instead of a new draw, so a link keeps its quality
+    const Coord& transmitterPosition = transmission->getStartPosition();
+    const Coord& receiverPosition = arrival->getStartPosition();
+    double shadowing = getShadowingMap()->getShadowing(transmitterPosition, receiverPosition);
+    return computeMeanPathLoss(m(transmitterPosition.distance(receiverPosition))) * math::dB2fraction(-shadowing);
+}
+
+const LoRaShadowingMap *LoRaLogNormalShadowing::getShadowingMap() const
+{
+    if (!useShadowingMap)
+        return nullptr;
+    if (shadowingMap.isEmpty())
+        shadowingMap.generate(check_and_cast<const IRadioMedium *>(getParentModule()), shadowingMapResolution, decorrelationDistance, sigma, getRNG(0));
+    return &shadowingMap;
+}
+
 double LoRaLogNormalShadowing::computePathLoss(mps propagationSpeed, Hz frequency, m distance) const
+{
+    return computeMeanPathLoss(distance) * math::dB2fraction(-normal(0.0, sigma));
+}
+
+double LoRaLogNormalShadowing::computeMeanPathLoss(m distance) const
 {
     // parameters taken from paper "Do LoRa Low-Power Wide-Area Networks Scale?"
     double PL_d0_db = 127.41;
-    double PL_db = PL_d0_db + 10 * gamma * log10(unit(distance / d0).get()) + normal(0.0, sigma);
+    double PL_db = PL_d0_db + 10 * gamma * log10(unit(distance / d0).get());
     return math::dB2fraction(-PL_db);
 }
 
@@ -64,4 +92,11 @@ m LoRaLogNormalShadowing::computeRange(W transmissionPower) const
     return m(distance);
 }
 
+m LoRaLogNormalShadowing::computeRange(W transmissionPower, W receptionPower) const
+{
+    double PL_d0_db = 127.41;
+    double PL_db = math::fraction2dB(unit(transmissionPower / receptionPower).get());
+    return d0 * pow(10, (PL_db - PL_d0_db) / (10 * gamma));
+}
+
 }
@@ -17,6 +17,7 @@
 #define LORAPHY_LORALOGNORMALSHADOWING_H_
 
 #include "inet/physicallayer/wireless/common/pathloss/FreeSpacePathLoss.h"
+#include "ILoRaPathLoss.h"
 
 using namespace inet;
 using namespace inet::physicallayer;
@@ -25,12 +26,16 @@ namespace flora_tdma {
 /**
  * This class implements the log normal shadowing model.
  */
-class LoRaLogNormalShadowing : public FreeSpacePathLoss
+class LoRaLogNormalShadowing : public FreeSpacePathLoss, public ILoRaPathLoss
 {
   protected:
     m d0;
     double gamma;
     double sigma;
+    bool useShadowingMap;
+    double shadowingMapResolution;
+    double decorrelationDistance;
+    mutable LoRaShadowingMap shadowingMap; // Made on first use, when the constraint area is known
 
   protected:
     virtual void initialize(int stage) override;
@@ -38,8 +43,14 @@ class LoRaLogNormalShadowing : public FreeSpacePathLoss
   public:
     LoRaLogNormalShadowing();
     virtual std::ostream& printToStream(std::ostream& stream, int level, int evFlags = 0) const override;
+    virtual double computePathLoss(const ITransmission *transmission, const IArrival *arrival) const override;
     virtual double computePathLoss(mps propagationSpeed, Hz frequency, m distance) const override;
+    virtual double computeMeanPathLoss(m distance) const override;
+    virtual double getShadowingSigma() const override { return sigma; }
+    virtual const LoRaShadowingMap *getShadowingMap() const override;
     m computeRange(W transmissionPower) const;
+    /** Distance at which the mean path loss brings the power down to receptionPower. */
+    m computeRange(W transmissionPower, W receptionPower) const;
 };
 
 } // namespace inet
@@ -16,6 +16,12 @@
 #include "../LoRa/LoRaMacFrame_m.h"
 #include "LoRaBandListening.h"
 #include "LoRaTransmission.h"
+#include "LoRaPhyPreamble_m.h"
+#include "LoRaReceiver.h"
+#include "../LoRa/LoRaGWRadio.h"
+#include "../LoRa/LoRaTDMAGWFrame.h"
+#include "../LoRa/LoRaTDMAMacFrame_m.h"
+#include "inet/common/packet/chunk/SequenceChunk.h"
 #include "inet/common/INETUtils.h"
 #include "inet/common/ModuleAccess.h"
 #include "inet/common/Simsignals.h"
@@ -41,10 +47,237 @@ LoRaMedium::~LoRaMedium()
 {
 }
 
+void LoRaMedium::initialize(int stage)
+{
+    RadioMedium::initialize(stage);
+    if (stage == INITSTAGE_LOCAL) {
+        skipSleepingReceivers = par("skipSleepingReceivers");
+        numDeferredArrivals = 0;
+        numLateArrivals = 0;
+
+        const char *deliveryPolicyString = par("deliveryPolicy");
+        if (!strcmp(deliveryPolicyString, "all"))
+            deliveryPolicy = DELIVER_ALL;
+        else if (!strcmp(deliveryPolicyString, "role"))
+            deliveryPolicy = DELIVER_BY_ROLE;
+        else
+            throw cRuntimeError("Unknown deliveryPolicy: %s", deliveryPolicyString);
+        overhearForInterference = par("overhearForInterference");
+        numFilteredDeliveries = 0;
+
+        rangeCulling = par("rangeCulling");
+        cullingMargin = par("cullingMargin");
+        shadowing = dynamic_cast<const LoRaLogNormalShadowing *>(pathLoss);
+        if (rangeCulling && shadowing == nullptr) {
+            EV_WARN << "Range culling needs the LoRaLogNormalShadowing path loss, every radio gets every arrival" << endl;
+            rangeCulling = false;
+        }
+        numCulledArrivals = 0;
+        if (deliveryPolicy == DELIVER_BY_ROLE || rangeCulling)
+            subscribe(signalRemovedSignal, this); // Our own, to forget what we kept about a transmission
+    }
+}
+
+void LoRaMedium::finish()
+{
+    RadioMedium::finish();
+    recordScalar("numDeferredArrivals", numDeferredArrivals);
+    recordScalar("numLateArrivals", numLateArrivals);
+    recordScalar("numFilteredDeliveries", numFilteredDeliveries);
+    recordScalar("numCulledArrivals", numCulledArrivals);
+}
+
+void LoRaMedium::addRadio(const IRadio *radio)
+{
+    RadioMedium::addRadio(radio);
+    radioIndices[radio->getId()] = indexedRadios.size();
+    indexedRadios.push_back(radio);
+    // We have to know when a sleeping radio starts listening, what is in the air then concerns it again
+    cModule *radioModule = const_cast<cModule *>(check_and_cast<const cModule *>(radio));
+    if (!radioModule->isSubscribed(IRadio::radioModeChangedSignal, this))
+        radioModule->subscribe(IRadio::radioModeChangedSignal, this);
+
+    // With the ALOHA model any overlap destroys a reception, however weak the interferer, so no radio is out of range
+    const LoRaReceiver *receiver = dynamic_cast<const LoRaReceiver *>(radio->getReceiver());
+    if (rangeCulling && receiver != nullptr && receiver->isAlohaChannelModel()) {
+        EV_WARN << "Range culling is turned off, " << radio << " uses the ALOHA channel model" << endl;
+        rangeCulling = false;
+        spatialGrid.clear();
+    }
+    if (spatialGrid.getNumRadios() > 0)
+        spatialGrid.addRadio(radio);
+}
+
+void LoRaMedium::removeRadio(const IRadio *radio)
+{
+    spatialGrid.removeRadio(radio);
+    int index = getRadioIndex(radio->getId());
+    if (index != -1)
+        indexedRadios[index] = nullptr; // The other indices stay as they are
+    RadioMedium::removeRadio(radio);
+}
+
+void LoRaMedium::buildSpatialGrid()
+{
+    // The path loss reads its sigma in the same init stage as the medium, so the default margin is only set here
+    if (std::isnan(cullingMargin))
+        cullingMargin = 3 * shadowing->getShadowingSigma();
+    // One cell per SF7 range, the shortest, so a query at a higher SF looks at a few more
+    // cells instead of a lot more radios
+    spatialGrid.setCellSize(shadowing->computeRange(mediumLimitCache->getMaxTransmissionPower() * math::dB2fraction(cullingMargin), LoRaReceiver::getMinRelevantPower(7, Hz(125000))));
+    communicationCache->mapRadios([&] (const IRadio *radio) {
+        if (radio != nullptr)
+            spatialGrid.addRadio(radio);
+    });
+    EV_DETAIL << "Built a spatial grid of " << spatialGrid.getCellSize() << " cells over " << spatialGrid.getNumRadios() << " radios" << endl;
+}
+
+m LoRaMedium::getCullingRange(const ITransmission *transmission) const
+{
+    const LoRaTransmission *loRaTransmission = check_and_cast<const LoRaTransmission *>(transmission);
+    double antennaGain = mediumLimitCache->getMaxAntennaGain();
+    W minPower = LoRaReceiver::getMinRelevantPower(loRaTransmission->getLoRaSF(), loRaTransmission->getLoRaBW());
+    return shadowing->computeRange(loRaTransmission->getLoRaTP() * antennaGain * antennaGain * math::dB2fraction(cullingMargin), minPower);
+}
+
+bool LoRaMedium::isOutOfRange(const IRadio *radio, const ITransmission *transmission) const
+{
+    if (!rangeCulling)
+        return false;
+    // Every radio around is tested against the same transmission, the range is only worked out once
+    auto it = transmissionRanges.find(transmission->getId());
+    if (it == transmissionRanges.end()) {
+        double range = getCullingRange(transmission).get();
+        it = transmissionRanges.emplace(transmission->getId(), range * range).first;
+    }
+    return radio->getAntenna()->getMobility()->getCurrentPosition().sqrdist(transmission->getStartPosition()) > it->second;
+}
+
+void LoRaMedium::receiveSignal(cComponent *source, simsignal_t signal, intval_t value, cObject *details)
+{
+    // The base class may listen to the radio mode too, it keeps its handling
+    RadioMedium::receiveSignal(source, signal, value, details);
+    if (signal != IRadio::radioModeChangedSignal || !skipSleepingReceivers
+            || (value != IRadio::RADIO_MODE_RECEIVER && value != IRadio::RADIO_MODE_TRANSCEIVER))
+        return;
+
+    // The radio woke up: the signals still in the air interfere with what it receives from now on
+    const IRadio *radio = check_and_cast<const IRadio *>(source);
+    communicationCache->mapTransmissions([&] (const ITransmission *transmission) {
+        if (transmission->getTransmitterRadioId() != radio->getId() && communicationCache->getCachedArrival(radio, transmission) == nullptr
+                && (overhearForInterference || isAddressee(radio, transmission)) && !isOutOfRange(radio, transmission)) {
+            numLateArrivals++;
+            cacheArrival(radio, transmission);
+        }
+    });
+}
+
+void LoRaMedium::receiveSignal(cComponent *source, simsignal_t signal, cObject *value, cObject *details)
+{
+    if (signal == signalRemovedSignal) {
+        int transmissionId = check_and_cast<const ITransmission *>(value)->getId();
+        transmissionAddressees.erase(transmissionId);
+        transmissionRanges.erase(transmissionId);
+        return;
+    }
+    RadioMedium::receiveSignal(source, signal, value, details);
+}
+
+bool LoRaMedium::isAsleep(const IRadio *radio) const
+{
+    IRadio::RadioMode radioMode = radio->getRadioMode();
+    return skipSleepingReceivers && (radioMode == IRadio::RADIO_MODE_SLEEP || radioMode == IRadio::RADIO_MODE_OFF);
+}
+
+bool LoRaMedium::isPotentialReceiver(const IRadio *radio, const ITransmission *transmission) const
+{
+    // A sleeping radio drops the signal anyway, so it is not even sent to it
+    if (isAsleep(radio) || isOutOfRange(radio, transmission) || !RadioMedium::isPotentialReceiver(radio, transmission))
+        return false;
+    // Only counted when the radio would have got the frame otherwise
+    if (!isAddressee(radio, transmission)) {
+        numFilteredDeliveries++;
+        return false;
+    }
+    return true;
+}
+
+Ptr<const Chunk> LoRaMedium::getMacHeader(const Packet *packet) const
+{
+    // The radio puts its preamble in front of the MAC frame
+    const auto &content = packet->peekAll();
+    const auto &sequence = dynamicPtrCast<const SequenceChunk>(content);
+    if (sequence == nullptr)
+        return content;
+    for (const auto &chunk : sequence->getChunks())
+        if (dynamicPtrCast<const LoRaPhyPreamble>(chunk) == nullptr)
+            return chunk;
+    return nullptr;
+}
+
+LoRaMedium::Addressees LoRaMedium::getAddressees(const ITransmission *transmission) const
+{
+    // Every radio around asks about the same transmission, the header only has to be looked at once
+    auto it = transmissionAddressees.find(transmission->getId());
+    if (it != transmissionAddressees.end())
+        return it->second;
+    const auto &macHeader = getMacHeader(transmission->getPacket());
+    Addressees addressees = ADDRESSED_TO_ALL; // Anything else, e.g. a LoRaMacFrame, is left to the MAC address filter
+    if (dynamicPtrCast<const LoRaTDMAMacFrame>(macHeader) != nullptr)
+        addressees = ADDRESSED_TO_GATEWAYS; // Uplinks and join requests, only a gateway does anything with them
+    else if (dynamicPtrCast<const LoRaTDMAGWFrame>(macHeader) != nullptr)
+        addressees = ADDRESSED_TO_NODES; // Beacons, gateways do not listen to each other
+    transmissionAddressees[transmission->getId()] = addressees;
+    return addressees;
+}
+
+bool LoRaMedium::isAddressee(const IRadio *radio, const ITransmission *transmission) const
+{
+    if (deliveryPolicy == DELIVER_ALL)
+        return true;
+    Addressees addressees = getAddressees(transmission);
+    if (addressees == ADDRESSED_TO_ALL)
+        return true;
+    bool isGateway = dynamic_cast<const LoRaGWRadio *>(radio) != nullptr;
+    return isGateway == (addressees == ADDRESSED_TO_GATEWAYS);
+}
+
+const IArrival *LoRaMedium::cacheArrival(const IRadio *receiverRadio, const ITransmission *transmission) const
+{
+    const IArrival *arrival = propagation->computeArrival(transmission, receiverRadio->getAntenna()->getMobility());
+    const IntervalTree::Interval *interval = new IntervalTree::Interval(arrival->getStartTime(), arrival->getEndTime(), (void *)transmission);
+    const LoRaTransmission *loRaTransmission = check_and_cast<const LoRaTransmission *>(transmission);
+    LoRaBandListening *loraListening = new LoRaBandListening(receiverRadio, arrival->getStartTime(), arrival->getEndTime(), arrival->getStartPosition(), arrival->getEndPosition(), loRaTransmission->getLoRaCF(), loRaTransmission->getLoRaBW(), loRaTransmission->getLoRaSF());
+    communicationCache->setCachedArrival(receiverRadio, transmission, arrival);
+    communicationCache->setCachedInterval(receiverRadio, transmission, interval);
+    communicationCache->setCachedListening(receiverRadio, transmission, loraListening);
+    return arrival;
+}
+
+const IArrival *LoRaMedium::getArrival(const IRadio *receiver, const ITransmission *transmission) const
+{
+    // Left out while the radio slept, so it is made now
+    const IArrival *arrival = communicationCache->getCachedArrival(receiver, transmission);
+    if (arrival == nullptr) {
+        numLateArrivals++;
+        arrival = cacheArrival(receiver, transmission);
+    }
+    return arrival;
+}
+
+const IListening *LoRaMedium::getListening(const IRadio *receiver, const ITransmission *transmission) const
+{
+    const IListening *listening = communicationCache->getCachedListening(receiver, transmission);
+    if (listening == nullptr) {
+        getArrival(receiver, transmission);
+        listening = communicationCache->getCachedListening(receiver, transmission);
+    }
+    return listening;
+}
+
 bool LoRaMedium::matchesMacAddressFilter(const IRadio *radio, const Packet *packet) const
 {
-    const auto &chunk = packet->peekAtFront<Chunk>();
-    const auto & loraHeader = dynamicPtrCast<const LoRaMacFrame>(chunk);
+    const auto & loraHeader = dynamicPtrCast<const LoRaMacFrame>(getMacHeader(packet));
     if (loraHeader == nullptr)
         return false;
     MacAddress address = MacAddress(loraHeader->getReceiverAddress().getInt());
@@ -99,20 +332,38 @@ void LoRaMedium::addTransmission(const IRadio *transmitterRadio, const ITransmis
     transmissionCount++;
     communicationCache->addTransmission(transmission);
     simtime_t maxArrivalEndTime = transmission->getEndTime();
-    communicationCache->mapRadios([&] (const IRadio *receiverRadio) {
+    auto addArrival = [&] (const IRadio *receiverRadio) {
         if (receiverRadio != nullptr && receiverRadio != transmitterRadio && receiverRadio->getReceiver() != nullptr) {
-            const IArrival *arrival = propagation->computeArrival(transmission, receiverRadio->getAntenna()->getMobility());
-            const IntervalTree::Interval *interval = new IntervalTree::Interval(arrival->getStartTime(), arrival->getEndTime(), (void *)transmission);
-            const LoRaTransmission *loRaTransmission = check_and_cast<const LoRaTransmission *>(transmission);
-            LoRaBandListening *loraListening = new LoRaBandListening(receiverRadio, arrival->getStartTime(), arrival->getEndTime(), arrival->getStartPosition(), arrival->getEndPosition(), loRaTransmission->getLoRaCF(), loRaTransmission->getLoRaBW(), loRaTransmission->getLoRaSF());
-            const simtime_t arrivalEndTime = arrival->getEndTime();
+            // With TDMA nearly every node sleeps, they get their arrival when they wake up or ask for it
+            if (isAsleep(receiverRadio)) {
+                numDeferredArrivals++;
+                return;
+            }
+            // Without overhearing a frame does not exist at all for the radios it is not meant for
+            if (!overhearForInterference && !isAddressee(receiverRadio, transmission))
+                return;
+            const simtime_t arrivalEndTime = cacheArrival(receiverRadio, transmission)->getEndTime();
             if (arrivalEndTime > maxArrivalEndTime)
                 maxArrivalEndTime = arrivalEndTime;
-            communicationCache->setCachedArrival(receiverRadio, transmission, arrival);
-            communicationCache->setCachedInterval(receiverRadio, transmission, interval);
-            communicationCache->setCachedListening(receiverRadio, transmission, loraListening);
         }
-    });
+    };
+    if (rangeCulling) {
+        // Only the radios around the transmitter, further away it is too weak to be received or to destroy a reception
+        if (spatialGrid.getNumRadios() == 0)
+            buildSpatialGrid();
+        long numArrivals = 0;
+        m range = getCullingRange(transmission);
+        transmissionRanges[transmission->getId()] = range.get() * range.get();
+        spatialGrid.mapRadios(transmission->getStartPosition(), range, [&] (const IRadio *receiverRadio) {
+            numArrivals++;
+            addArrival(receiverRadio);
+        });
+        numCulledArrivals += spatialGrid.getNumRadios() - numArrivals;
+    }
+    else
+        communicationCache->mapRadios(addArrival);
+    // A radio that wakes up later is no further away than the range the medium considers, the
+    // longest transmission added below covers its propagation delay many times over
     communicationCache->setCachedInterferenceEndTime(transmission, maxArrivalEndTime + mediumLimitCache->getMaxTransmissionDuration());
     if (!removeNonInterferingTransmissionsTimer->isScheduled())
         scheduleAt(communicationCache->getCachedInterferenceEndTime(transmission), removeNonInterferingTransmissionsTimer);
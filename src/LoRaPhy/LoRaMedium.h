@@ -16,6 +16,8 @@
 #define LORAPHY_LORAMEDIUM_H_
 #include "inet/physicallayer/wireless/common/medium/RadioMedium.h"
 #include "LoRa/LoRaRadio.h"
+#include "LoRaLogNormalShadowing.h"
+#include "LoRaSpatialGrid.h"
 #include "../LoRa/LoRaMacFrame_m.h"
 
 #include "inet/common/IntervalTree.h"
@@ -29,6 +31,7 @@
 #include "inet/physicallayer/wireless/common/contract/packetlevel/INeighborCache.h"
 #include "inet/physicallayer/wireless/common/contract/packetlevel/IRadioMedium.h"
 #include <algorithm>
+#include <unordered_map>
 
 namespace flora_tdma {
 class LoRaMedium : public RadioMedium
@@ -37,13 +40,78 @@ class LoRaMedium : public RadioMedium
     friend class LoRaRadio;
 
 protected:
+    /** @name Sleeping receivers */
+    //@{
+    bool skipSleepingReceivers; // Leave out radios that sleep or are off when a transmission starts, until they need it
+    mutable long numDeferredArrivals; // Arrivals not computed when the transmission started
+    mutable long numLateArrivals; // Of those, computed later after all
+    //@}
+
+    /** @name Delivery policy */
+    //@{
+    enum DeliveryPolicy {
+      DELIVER_ALL,     // every frame reaches every radio in range
+      DELIVER_BY_ROLE, // TDMA uplinks reach only gateways, TDMA beacons only nodes
+    };
+    DeliveryPolicy deliveryPolicy;
+    bool overhearForInterference; // Frames a radio is not meant to receive still interfere at it
+    mutable long numFilteredDeliveries; // Receptions not started because of the delivery policy
+    enum Addressees {
+      ADDRESSED_TO_ALL,      // left to the MAC address filter
+      ADDRESSED_TO_GATEWAYS, // TDMA uplinks and join requests
+      ADDRESSED_TO_NODES,    // TDMA beacons
+    };
+    mutable std::unordered_map<int, Addressees> transmissionAddressees; // By transmission id, the header is only peeked once until the transmission is removed
+    //@}
+
+    /** @name Range culling */
+    //@{
+    bool rangeCulling; // Only make arrivals for radios a transmission can matter to
+    double cullingMargin; // dB below the weakest relevant power, for the shadowing around the mean path loss. NaN until the grid is built means 3 sigma
+    const LoRaLogNormalShadowing *shadowing = nullptr;
+    LoRaSpatialGrid spatialGrid; // Empty until the first transmission, when all radios are known
+    long numCulledArrivals; // Arrivals not made for radios out of range
+    mutable std::unordered_map<int, double> transmissionRanges; // Squared culling range in m^2 by transmission id, until the transmission is removed
+    //@}
+
+    /** @name Radio indices */
+    //@{
+    std::vector<const IRadio *> indexedRadios; // In the order they registered, the same in every run of a network
+    std::unordered_map<int, int> radioIndices; // Radio id to its index
+    //@}
+
+    virtual void initialize(int stage) override;
+    virtual void finish() override;
     virtual bool matchesMacAddressFilter(const IRadio *radio, const Packet *packet) const override;
+    virtual bool isPotentialReceiver(const IRadio *receiver, const ITransmission *transmission) const override;
+    virtual bool isAsleep(const IRadio *radio) const;
+    virtual Ptr<const Chunk> getMacHeader(const Packet *packet) const;
+    virtual Addressees getAddressees(const ITransmission *transmission) const;
+    virtual bool isAddressee(const IRadio *radio, const ITransmission *transmission) const;
+    virtual m getCullingRange(const ITransmission *transmission) const;
+    virtual bool isOutOfRange(const IRadio *radio, const ITransmission *transmission) const;
+    virtual void buildSpatialGrid();
+    virtual const IArrival *cacheArrival(const IRadio *receiverRadio, const ITransmission *transmission) const;
         //@}
     public:
       LoRaMedium();
       virtual ~LoRaMedium();
+      virtual void addRadio(const IRadio *radio) override;
+      virtual void removeRadio(const IRadio *radio) override;
+
+      /** Dense index of the radio by registration order, -1 for radios that never registered. */
+      int getRadioIndex(int radioId) const { auto it = radioIndices.find(radioId); return it == radioIndices.end() ? -1 : it->second; }
+      int getNumIndexedRadios() const { return indexedRadios.size(); }
+      /** nullptr if the radio of that index was removed again. */
+      const IRadio *getIndexedRadio(int index) const { return indexedRadios[index]; }
+      virtual const IArrival *getArrival(const IRadio *receiver, const ITransmission *transmission) const override;
+      virtual const IListening *getListening(const IRadio *receiver, const ITransmission *transmission) const override;
       virtual const IReceptionResult *getReceptionResult(const IRadio *receiver, const IListening *listening, const ITransmission *transmission) const override;
       virtual void addTransmission(const IRadio *transmitter, const ITransmission *transmission) override;
+
+      using RadioMedium::receiveSignal;
+      virtual void receiveSignal(cComponent *source, simsignal_t signal, intval_t value, cObject *details) override;
+      virtual void receiveSignal(cComponent *source, simsignal_t signal, cObject *value, cObject *details) override;
 };
 }
 #endif /* LORAPHY_LORAMEDIUM_H_ */
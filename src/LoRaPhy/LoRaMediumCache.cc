@@ -60,6 +60,28 @@ inline double maxIgnoreNaN(double a, double b)
         return b;
 }
 
+inline void insertIgnoreNaN(std::multiset<double>& values, double value)
+{
+    if (!std::isnan(value))
+        values.insert(value);
+}
+
+inline void eraseIgnoreNaN(std::multiset<double>& values, double value)
+{
+    if (!std::isnan(value))
+        values.erase(values.find(value)); // Only one of them, another radio may have the same
+}
+
+inline double getMin(const std::multiset<double>& values)
+{
+    return values.empty() ? NaN : *values.begin();
+}
+
+inline double getMax(const std::multiset<double>& values)
+{
+    return values.empty() ? NaN : *values.rbegin();
+}
+
 LoRaMediumCache::LoRaMediumCache() :
     radioMedium(nullptr),
     minConstraintArea(Coord::NIL),
@@ -123,70 +145,85 @@ void LoRaMediumCache::updateLimits()
     maxAntennaGain = computeMaxAntennaGain();
     minInterferenceTime = computeMinInterferenceTime();
     maxTransmissionDuration = computeMaxTransmissionDuration();
-    maxCommunicationRange = getMaxCommunicationRange();
+    maxCommunicationRange = computeMaxCommunicationRange();
     maxInterferenceRange = computeMaxInterferenceRange();
 }
 
 void LoRaMediumCache::addRadio(const IRadio *radio)
 {
-    radios.push_back(radio);
+    if (radio == nullptr)
+        return;
+    // Every limit is kept up to date as radios come and go, instead of going over all of them every time
+    const IMobility *mobility = radio->getAntenna()->getMobility();
+    RadioLimits limits;
+    limits.maxSpeed = mobility->getMaxSpeed();
+    limits.maxTransmissionPower = radio->getTransmitter()->getMaxPower().get();
+    limits.minInterferencePower = radio->getReceiver()->getMinInterferencePower().get();
+    limits.minReceptionPower = radio->getReceiver()->getMinReceptionPower().get();
+    limits.maxAntennaGain = radio->getAntenna()->getGain()->getMaxGain();
+    limits.constraintAreaMin = mobility->getConstraintAreaMin();
+    limits.constraintAreaMax = mobility->getConstraintAreaMax();
+    if (!radios.emplace(radio, limits).second)
+        throw cRuntimeError("Radio %d is already on the medium", radio->getId());
+
+    insertIgnoreNaN(maxSpeeds, limits.maxSpeed);
+    insertIgnoreNaN(maxTransmissionPowers, limits.maxTransmissionPower);
+    insertIgnoreNaN(minInterferencePowers, limits.minInterferencePower);
+    insertIgnoreNaN(minReceptionPowers, limits.minReceptionPower);
+    insertIgnoreNaN(maxAntennaGains, limits.maxAntennaGain);
+    insertIgnoreNaN(constraintAreaMins[0], limits.constraintAreaMin.x);
+    insertIgnoreNaN(constraintAreaMins[1], limits.constraintAreaMin.y);
+    insertIgnoreNaN(constraintAreaMins[2], limits.constraintAreaMin.z);
+    insertIgnoreNaN(constraintAreaMaxs[0], limits.constraintAreaMax.x);
+    insertIgnoreNaN(constraintAreaMaxs[1], limits.constraintAreaMax.y);
+    insertIgnoreNaN(constraintAreaMaxs[2], limits.constraintAreaMax.z);
     updateLimits();
 }
 
 void LoRaMediumCache::removeRadio(const IRadio *radio)
 {
-    radios.erase(std::remove(radios.begin(), radios.end(), radio), radios.end());
+    auto it = radios.find(radio);
+    if (it == radios.end())
+        return;
+    const RadioLimits& limits = it->second;
+    eraseIgnoreNaN(maxSpeeds, limits.maxSpeed);
+    eraseIgnoreNaN(maxTransmissionPowers, limits.maxTransmissionPower);
+    eraseIgnoreNaN(minInterferencePowers, limits.minInterferencePower);
+    eraseIgnoreNaN(minReceptionPowers, limits.minReceptionPower);
+    eraseIgnoreNaN(maxAntennaGains, limits.maxAntennaGain);
+    eraseIgnoreNaN(constraintAreaMins[0], limits.constraintAreaMin.x);
+    eraseIgnoreNaN(constraintAreaMins[1], limits.constraintAreaMin.y);
+    eraseIgnoreNaN(constraintAreaMins[2], limits.constraintAreaMin.z);
+    eraseIgnoreNaN(constraintAreaMaxs[0], limits.constraintAreaMax.x);
+    eraseIgnoreNaN(constraintAreaMaxs[1], limits.constraintAreaMax.y);
+    eraseIgnoreNaN(constraintAreaMaxs[2], limits.constraintAreaMax.z);
+    radios.erase(it);
     updateLimits();
 }
 
 mps LoRaMediumCache::computeMaxSpeed() const
 {
-    mps maxSpeed = mps(par("maxSpeed"));
-    for (const auto radio : radios) {
-        if (radio != nullptr)
-            maxSpeed = maxIgnoreNaN(maxSpeed, mps(radio->getAntenna()->getMobility()->getMaxSpeed()));
-    }
-    return maxSpeed;
+    return maxIgnoreNaN(mps(par("maxSpeed")), mps(getMax(maxSpeeds)));
 }
 
 W LoRaMediumCache::computeMaxTransmissionPower() const
 {
-    W maxTransmissionPower = W(par("maxTransmissionPower"));
-    for (const auto radio : radios) {
-        if (radio != nullptr)
-            maxTransmissionPower = maxIgnoreNaN(maxTransmissionPower, radio->getTransmitter()->getMaxPower());
-    }
-    return maxTransmissionPower;
+    return maxIgnoreNaN(W(par("maxTransmissionPower")), W(getMax(maxTransmissionPowers)));
 }
 
 W LoRaMediumCache::computeMinInterferencePower() const
 {
-    W minInterferencePower = mW(math::dBmW2mW(par("minInterferencePower")));
-    for (const auto radio : radios) {
-        if (radio != nullptr)
-            minInterferencePower = minIgnoreNaN(minInterferencePower, radio->getReceiver()->getMinInterferencePower());
-    }
-    return minInterferencePower;
+    return minIgnoreNaN(W(mW(math::dBmW2mW(par("minInterferencePower")))), W(getMin(minInterferencePowers)));
 }
 
 W LoRaMediumCache::computeMinReceptionPower() const
 {
-    W minReceptionPower = mW(math::dBmW2mW(par("minReceptionPower")));
-    for (const auto radio : radios) {
-        if (radio != nullptr)
-            minReceptionPower = minIgnoreNaN(minReceptionPower, radio->getReceiver()->getMinReceptionPower());
-    }
-    return minReceptionPower;
+    return minIgnoreNaN(W(mW(math::dBmW2mW(par("minReceptionPower")))), W(getMin(minReceptionPowers)));
 }
 
 double LoRaMediumCache::computeMaxAntennaGain() const
 {
-    double maxAntennaGain = math::dB2fraction(par("maxAntennaGain"));
-    for (const auto radio : radios) {
-        if (radio != nullptr)
-            maxAntennaGain = maxIgnoreNaN(maxAntennaGain, radio->getAntenna()->getGain()->getMaxGain());
-    }
-    return maxAntennaGain;
+    return maxIgnoreNaN(math::dB2fraction(par("maxAntennaGain")), getMax(maxAntennaGains));
 }
 
 m LoRaMediumCache::computeMaxRange(W maxTransmissionPower, W minReceptionPower) const
@@ -197,6 +234,16 @@ m LoRaMediumCache::computeMaxRange(W maxTransmissionPower, W minReceptionPower)
     return radioMedium->getPathLoss()->computeRange(radioMedium->getPropagation()->getPropagationSpeed(), carrierFrequency, loss);
 }
 
+m LoRaMediumCache::computeMaxCommunicationRange() const
+{
+    m maxCommunicationRange = maxIgnoreNaN(m(par("maxCommunicationRange")), computeMaxRange(maxTransmissionPower, minReceptionPower));
+    // The LoRaReceiver has no minimum reception power, the shadowing model knows the range of the most sensitive SF
+    const LoRaLogNormalShadowing *loraLogNormalShadowing = dynamic_cast<const LoRaLogNormalShadowing *>(radioMedium->getPathLoss());
+    if (loraLogNormalShadowing != nullptr && !std::isnan(maxTransmissionPower.get()))
+        maxCommunicationRange = maxIgnoreNaN(maxCommunicationRange, loraLogNormalShadowing->computeRange(maxTransmissionPower));
+    return maxCommunicationRange;
+}
+
 m LoRaMediumCache::computeMaxInterferenceRange() const
 {
     return maxIgnoreNaN(m(par("maxInterferenceRange")), computeMaxRange(maxTransmissionPower, minInterferencePower));
@@ -214,26 +261,16 @@ const simtime_t LoRaMediumCache::computeMaxTransmissionDuration() const
 
 Coord LoRaMediumCache::computeMinConstraintArea() const
 {
-    Coord minConstraintArea = Coord::NIL;
-    for (const auto radio : radios) {
-        if (radio != nullptr) {
-            const IMobility *mobility = radio->getAntenna()->getMobility();
-            minConstraintArea = minConstraintArea.min(mobility->getConstraintAreaMin());
-        }
-    }
-    return minConstraintArea;
+    if (radios.empty())
+        return Coord::NIL;
+    return Coord(getMin(constraintAreaMins[0]), getMin(constraintAreaMins[1]), getMin(constraintAreaMins[2]));
 }
 
 Coord LoRaMediumCache::computeMaxConstreaintArea() const
 {
-    Coord maxConstraintArea = Coord::NIL;
-    for (const auto radio : radios) {
-        if (radio != nullptr) {
-            const IMobility *mobility = radio->getAntenna()->getMobility();
-            maxConstraintArea = maxConstraintArea.max(mobility->getConstraintAreaMax());
-        }
-    }
-    return maxConstraintArea;
+    if (radios.empty())
+        return Coord::NIL;
+    return Coord(getMax(constraintAreaMaxs[0]), getMax(constraintAreaMaxs[1]), getMax(constraintAreaMaxs[2]));
 }
 
 m LoRaMediumCache::getMaxInterferenceRange(const IRadio* radio) const
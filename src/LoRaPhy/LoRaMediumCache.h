@@ -21,6 +21,8 @@
 #include "inet/physicallayer/wireless/common/contract/packetlevel/IRadioMedium.h"
 #include "inet/physicallayer/wireless/common/contract/packetlevel/IMediumLimitCache.h"
 #include "LoRaPhy/LoRaMedium.h"
+#include <map>
+#include <set>
 
 namespace flora_tdma {
 
@@ -33,9 +35,34 @@ class LoRaMediumCache : public cModule, public IMediumLimitCache
     const LoRaMedium *radioMedium;
 
     /**
-     * The list of communicating radios on the medium.
+     * What one radio contributes to the limits, as it was when the radio was
+     * added, so it can be taken out again.
      */
-    std::vector<const IRadio *> radios;
+    struct RadioLimits {
+        double maxSpeed;
+        double maxTransmissionPower;
+        double minInterferencePower;
+        double minReceptionPower;
+        double maxAntennaGain;
+        Coord constraintAreaMin;
+        Coord constraintAreaMax;
+    };
+
+    /**
+     * The communicating radios on the medium.
+     */
+    std::map<const IRadio *, RadioLimits> radios;
+
+    /** @name The values of all radios, NaN left out, so a limit is the first or last one. */
+    //@{
+    std::multiset<double> maxSpeeds;
+    std::multiset<double> maxTransmissionPowers;
+    std::multiset<double> minInterferencePowers;
+    std::multiset<double> minReceptionPowers;
+    std::multiset<double> maxAntennaGains;
+    std::multiset<double> constraintAreaMins[3]; // x, y and z
+    std::multiset<double> constraintAreaMaxs[3];
+    //@}
 
     /** @name Various radio medium limits. */
     /**
@@ -118,6 +145,7 @@ class LoRaMediumCache : public cModule, public IMediumLimitCache
     virtual const simtime_t computeMaxTransmissionDuration() const;
 
     virtual m computeMaxRange(W maxTransmissionPower, W minReceptionPower) const;
+    virtual m computeMaxCommunicationRange() const;
     virtual m computeMaxInterferenceRange() const;
 
     virtual void updateLimits();
@@ -17,6 +17,7 @@
 
 #include "LoRaPhy/LoRaNeighborCache.h"
 #include "inet/common/ModuleAccess.h"
+#include <algorithm>
 
 namespace flora_tdma {
 
@@ -27,7 +28,9 @@ LoRaNeighborCache::LoRaNeighborCache() :
     updateNeighborListsTimer(nullptr),
     refillPeriod(NaN),
     range(NaN),
-    maxSpeed(NaN)
+    maxSpeed(NaN),
+    radius(NaN),
+    built(false)
 {
 }
 
@@ -40,6 +43,7 @@ void LoRaNeighborCache::initialize(int stage)
         updateNeighborListsTimer = new cMessage("updateNeighborListsTimer");
     }
     else if (stage == INITSTAGE_PHYSICAL_LAYER_NEIGHBOR_CACHE) {
+        // All radios have registered by now, so the lists are made once instead of on every registration
         maxSpeed = radioMedium->getMediumLimitCache()->getMaxSpeed().get();
         updateNeighborLists();
         if (maxSpeed != 0)
@@ -86,20 +90,15 @@ void LoRaNeighborCache::handleMessage(cMessage *msg)
 
 void LoRaNeighborCache::updateNeighborList(RadioEntry *radioEntry)
 {
-    IMobility *radioMobility = radioEntry->radio->getAntenna()->getMobility();
-    Coord radioPosition = radioMobility->getCurrentPosition();
-    double radius = maxSpeed * refillPeriod + range;
     radioEntry->neighborVector.clear();
-
-    for (auto & elem : radios) {
-        const IRadio *otherRadio = elem->radio;
-        Coord otherEntryPosition = otherRadio->getAntenna()->getMobility()->getCurrentPosition();
-
-        if (otherRadio->getId() != radioEntry->radio->getId() &&
-            otherEntryPosition.sqrdist(radioPosition) <= radius * radius)
+    grid.mapRadios(radioEntry->position, m(radius), [&] (const IRadio *otherRadio) {
+        if (otherRadio->getId() != radioEntry->radio->getId())
             radioEntry->neighborVector.push_back(otherRadio);
-    }
-
+    });
+    // Same order as the radios registered, so the signals are sent in the same order as before
+    std::sort(radioEntry->neighborVector.begin(), radioEntry->neighborVector.end(), [] (const IRadio *a, const IRadio *b) {
+        return a->getId() < b->getId();
+    });
 }
 
 void LoRaNeighborCache::addRadio(const IRadio *radio)
@@ -107,39 +106,65 @@ void LoRaNeighborCache::addRadio(const IRadio *radio)
     RadioEntry *newEntry = new RadioEntry(radio);
     radios.push_back(newEntry);
     radioToEntry[radio] = newEntry;
-    updateNeighborLists();
+    double oldMaxSpeed = maxSpeed;
     maxSpeed = radioMedium->getMediumLimitCache()->getMaxSpeed().get();
+    if (built) {
+        if (maxSpeed != oldMaxSpeed && !(std::isnan(maxSpeed) && std::isnan(oldMaxSpeed)))
+            updateNeighborLists(); // The radius changed for everybody
+        else {
+            // Only the new radio and the ones around it have to know about each other
+            newEntry->position = radio->getAntenna()->getMobility()->getCurrentPosition();
+            grid.addRadio(radio, newEntry->position);
+            updateNeighborList(newEntry);
+            for (auto neighbor : newEntry->neighborVector) {
+                Radios& neighborVector = radioToEntry[neighbor]->neighborVector;
+                neighborVector.insert(std::upper_bound(neighborVector.begin(), neighborVector.end(), radio, [] (const IRadio *a, const IRadio *b) {
+                    return a->getId() < b->getId();
+                }), radio);
+            }
+        }
+    }
     if (maxSpeed != 0 && !updateNeighborListsTimer->isScheduled() && initialized())
         scheduleAt(simTime() + refillPeriod, updateNeighborListsTimer);
 }
 
 void LoRaNeighborCache::removeRadio(const IRadio *radio)
 {
-    auto it = find(radios.begin(), radios.end(), radioToEntry[radio]);
-    if (it != radios.end()) {
-        removeRadioFromNeighborLists(radio);
-        radios.erase(it);
-        maxSpeed = radioMedium->getMediumLimitCache()->getMaxSpeed().get();
-        if (maxSpeed == 0 && initialized())
-            cancelEvent(updateNeighborListsTimer);
-    }
-    else {
+    auto entryIt = radioToEntry.find(radio);
+    if (entryIt == radioToEntry.end())
         throw cRuntimeError("You can't remove radio: %d because it is not in our radio vector", radio->getId());
-    }
+    RadioEntry *radioEntry = entryIt->second;
+    removeRadioFromNeighborLists(radioEntry);
+    grid.removeRadio(radio);
+    radios.erase(std::find(radios.begin(), radios.end(), radioEntry));
+    radioToEntry.erase(entryIt);
+    delete radioEntry;
+    maxSpeed = radioMedium->getMediumLimitCache()->getMaxSpeed().get();
+    if (maxSpeed == 0 && initialized())
+        cancelEvent(updateNeighborListsTimer);
 }
 
 void LoRaNeighborCache::updateNeighborLists()
 {
     EV_DETAIL << "Updating the neighbor lists" << endl;
+    // A radio is looked up once, and then only compared with the radios in the cells around it
+    radius = range + (maxSpeed > 0 ? maxSpeed * refillPeriod : 0);
+    grid.setCellSize(m(radius));
+    for (auto & elem : radios) {
+        elem->position = elem->radio->getAntenna()->getMobility()->getCurrentPosition();
+        grid.addRadio(elem->radio, elem->position);
+    }
     for (auto & elem : radios)
         updateNeighborList(elem);
+    built = true;
 }
 
-void LoRaNeighborCache::removeRadioFromNeighborLists(const IRadio *radio)
+void LoRaNeighborCache::removeRadioFromNeighborLists(RadioEntry *radioEntry)
 {
-    for (auto & elem : radios) {
-        Radios neighborVector = elem->neighborVector;
-        auto it = find(neighborVector.begin(), neighborVector.end(), radio);
+    // Being a neighbor goes both ways, so only the lists of its own neighbors can hold the radio
+    for (auto neighbor : radioEntry->neighborVector) {
+        Radios& neighborVector = radioToEntry[neighbor]->neighborVector;
+        auto it = find(neighborVector.begin(), neighborVector.end(), radioEntry->radio);
         if (it != neighborVector.end())
             neighborVector.erase(it);
     }
@@ -19,6 +19,7 @@
 
 #include "inet/physicallayer/wireless/common/medium/RadioMedium.h"
 #include "LoRaPhy/LoRaMedium.h"
+#include "LoRaPhy/LoRaSpatialGrid.h"
 #include <set>
 #include <vector>
 
@@ -31,6 +32,7 @@ class LoRaNeighborCache : public cSimpleModule, public INeighborCache
     {
         RadioEntry(const IRadio *radio) : radio(radio) {};
         const IRadio *radio;
+        Coord position; // Where the radio was when the lists were last made
         std::vector<const IRadio *> neighborVector;
         bool operator==(RadioEntry *rhs) const
         {
@@ -49,6 +51,9 @@ class LoRaNeighborCache : public cSimpleModule, public INeighborCache
     double refillPeriod;
     double range;
     double maxSpeed;
+    double radius; // Range plus how far a radio can move until the next refill
+    LoRaSpatialGrid grid; // The radios at their positions of the last refill
+    bool built; // The lists exist, from now on radios are linked in one by one
 
   protected:
     virtual int numInitStages() const override { return NUM_INIT_STAGES; }
@@ -56,7 +61,7 @@ class LoRaNeighborCache : public cSimpleModule, public INeighborCache
     virtual void handleMessage(cMessage *msg) override;
     void updateNeighborList(RadioEntry *radioEntry);
     void updateNeighborLists();
-    void removeRadioFromNeighborLists(const IRadio *radio);
+    void removeRadioFromNeighborLists(RadioEntry *radioEntry);
 
   public:
     LoRaNeighborCache();
@@ -31,14 +31,42 @@ void LoRaPathLossOulu::initialize(int stage)
         n = par("n");
         B = par("B");
         sigma = par("sigma");
+        useShadowingMap = par("shadowingMap");
+        shadowingMapResolution = m(par("shadowingMapResolution")).get();
+        decorrelationDistance = m(par("decorrelationDistance")).get();
         antennaGain = par("antennaGain");
     }
 }
 
+double LoRaPathLossOulu::computePathLoss(const ITransmission *transmission, const IArrival *arrival) const
+{
+    if (!useShadowingMap)
+        return FreeSpacePathLoss::computePathLoss(transmission, arrival);
+    // The shadowing of the place instead of a new draw, so a link keeps its quality
+    const Coord& transmitterPosition = transmission->getStartPosition();
+    const Coord& receiverPosition = arrival->getStartPosition();
+    double shadowing = getShadowingMap()->getShadowing(transmitterPosition, receiverPosition);
+    return computeMeanPathLoss(m(transmitterPosition.distance(receiverPosition))) * math::dB2fraction(-shadowing);
+}
+
+const LoRaShadowingMap *LoRaPathLossOulu::getShadowingMap() const
+{
+    if (!useShadowingMap)
+        return nullptr;
+    if (shadowingMap.isEmpty())
+        shadowingMap.generate(check_and_cast<const IRadioMedium *>(getParentModule()), shadowingMapResolution, decorrelationDistance, sigma, getRNG(0));
+    return &shadowingMap;
+}
+
 double LoRaPathLossOulu::computePathLoss(mps propagationSpeed, Hz frequency, m distance) const
+{
+    return computeMeanPathLoss(distance) * math::dB2fraction(-normal(0.0, sigma));
+}
+
+double LoRaPathLossOulu::computeMeanPathLoss(m distance) const
 {
     //EPL = B + 10nlog10( d / d0 )
-    double PL_db = B + 10 * n * log10(unit(distance/d0).get()) - antennaGain + normal(0.0, sigma);
+    double PL_db = B + 10 * n * log10(unit(distance/d0).get()) - antennaGain;
     return math::dB2fraction(-PL_db);
 }
 
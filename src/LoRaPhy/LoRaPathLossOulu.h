@@ -17,6 +17,7 @@
 #define LORAPHY_LORAPATHLOSSOULU_H_
 
 #include "inet/physicallayer/wireless/common/pathloss/FreeSpacePathLoss.h"
+#include "ILoRaPathLoss.h"
 
 using namespace inet;
 using namespace inet::physicallayer;
@@ -25,13 +26,17 @@ namespace flora_tdma {
 /**
  * This class implements the log normal shadowing model.
  */
-class LoRaPathLossOulu : public FreeSpacePathLoss
+class LoRaPathLossOulu : public FreeSpacePathLoss, public ILoRaPathLoss
 {
   protected:
     m d0;
     double n;
     double B;
     double sigma;
+    bool useShadowingMap;
+    double shadowingMapResolution;
+    double decorrelationDistance;
+    mutable LoRaShadowingMap shadowingMap; // Made on first use, when the constraint area is known
     double antennaGain;
 
   protected:
@@ -39,7 +44,11 @@ class LoRaPathLossOulu : public FreeSpacePathLoss
 
   public:
     LoRaPathLossOulu();
+    virtual double computePathLoss(const ITransmission *transmission, const IArrival *arrival) const override;
     virtual double computePathLoss(mps propagationSpeed, Hz frequency, m distance) const override;
+    virtual double computeMeanPathLoss(m distance) const override;
+    virtual double getShadowingSigma() const override { return sigma; }
+    virtual const LoRaShadowingMap *getShadowingMap() const override;
 };
 
 } // namespace inet
@@ -19,11 +19,23 @@
 #include "../LoRaApp/SimpleLoRaApp.h"
 #include "LoRaPhyPreamble_m.h"
 #include "inet/physicallayer/wireless/common/contract/packetlevel/SignalTag_m.h"
+#include "LoRa/LoRaGWRadio.h"
+#include "LoRaAirtime.h"
+#include "LoRaAnalogModel.h"
 
 namespace flora_tdma {
 
 Define_Module(LoRaReceiver);
 
+const int LoRaReceiver::nonOrthDelta[6][6] = {
+   {1, -8, -9, -9, -9, -9},
+   {-11, 1, -11, -12, -13, -13},
+   {-15, -13, 1, -13, -14, -15},
+   {-19, -18, -17, 1, -17, -18},
+   {-22, -22, -21, -20, 1, -20},
+   {-25, -25, -25, -24, -23, 1}
+};
+
 LoRaReceiver::LoRaReceiver() :
     snirThreshold(NaN)
 {
@@ -42,6 +54,9 @@ void LoRaReceiver::initialize(int stage)
         } else iAmGateway = false;
         alohaChannelModel = par("alohaChannelModel");
         LoRaReceptionCollision = registerSignal("LoRaReceptionCollision");
+        for (int receptionSF = 7; receptionSF <= 12; receptionSF++)
+            for (int interferenceSF = 7; interferenceSF <= 12; interferenceSF++)
+                captureRatio[receptionSF-7][interferenceSF-7] = math::dB2fraction(nonOrthDelta[receptionSF-7][interferenceSF-7]);
         numCollisions = 0;
         rcvBelowSensitivity = 0;
     }
@@ -58,8 +73,10 @@ bool LoRaReceiver::computeIsReceptionPossible(const IListening *listening, const
 {
     //here we can check compatibility of LoRaTx parameters (or beeing a gateway)
     const LoRaTransmission *loRaTransmission = check_and_cast<const LoRaTransmission *>(transmission);
+    if(iAmGateway)
+        return check_and_cast<LoRaGWRadio *>(getParentModule())->isListeningOn(loRaTransmission->getLoRaCF());
     auto *loRaRadio = check_and_cast<LoRaRadio *>(getParentModule());
-    if(iAmGateway || (loRaTransmission->getLoRaCF() == loRaRadio->loRaCF && loRaTransmission->getLoRaBW() == loRaRadio->loRaBW && loRaTransmission->getLoRaSF() == loRaRadio->loRaSF))
+    if(loRaTransmission->getLoRaCF() == loRaRadio->loRaCF && loRaTransmission->getLoRaBW() == loRaRadio->loRaBW && loRaTransmission->getLoRaSF() == loRaRadio->loRaSF)
         return true;
     else
         return false;
@@ -72,6 +89,9 @@ bool LoRaReceiver::computeIsReceptionPossible(const IListening *listening, const
     const LoRaReception *loRaReception = check_and_cast<const LoRaReception *>(reception);
     if (iAmGateway == false && (loRaListening->getLoRaCF() != loRaReception->getLoRaCF() || loRaListening->getLoRaBW() != loRaReception->getLoRaBW() || loRaListening->getLoRaSF() != loRaReception->getLoRaSF())) {
         return false;
+    } else if (iAmGateway && !check_and_cast<LoRaGWRadio *>(getParentModule())->isListeningOn(loRaReception->getLoRaCF())) {
+        // Not on one of our uplink channels
+        return false;
     } else {
         W minReceptionPower = loRaReception->computeMinPower(reception->getStartTime(part), reception->getEndTime(part));
         W sensitivity = getSensitivity(loRaReception);
@@ -117,87 +137,72 @@ bool LoRaReceiver::computeIsReceptionAttempted(const IListening *listening, cons
     }
 }
 
+void LoRaReceiver::InterfererBatch::clear()
+{
+    startTime.clear();
+    endTime.clear();
+    centerFrequency.clear();
+    spreadFactor.clear();
+    power.clear();
+}
+
+void LoRaReceiver::InterfererBatch::add(const LoRaReception *reception)
+{
+    startTime.push_back(reception->getStartTime().raw());
+    endTime.push_back(reception->getEndTime().raw());
+    centerFrequency.push_back(reception->getLoRaCF().get());
+    spreadFactor.push_back(reception->getLoRaSF());
+    power.push_back(reception->getPower().get());
+}
+
 bool LoRaReceiver::isPacketCollided(const IReception *reception, IRadioSignal::SignalPart part, const IInterference *interference) const
 {
     auto interferingReceptions = interference->getInterferingReceptions();
     const LoRaReception *loRaReception = check_and_cast<const LoRaReception *>(reception);
-    simtime_t m_x = (loRaReception->getStartTime() + loRaReception->getEndTime())/2;
-    simtime_t d_x = (loRaReception->getEndTime() - loRaReception->getStartTime())/2;
-    EV << "Czas transmisji to " << loRaReception->getEndTime() - loRaReception->getStartTime() << endl;
-    W signalRSSI_w = loRaReception->getPower();
-    double signalRSSI_mw = signalRSSI_w.get()*1000;
-    double signalRSSI_dBm = math::mW2dBmW(signalRSSI_mw);
-    EV << signalRSSI_mw << endl;
-    EV << signalRSSI_dBm << endl;
-    int receptionSF = loRaReception->getLoRaSF();
-    for (auto interferingReception : *interferingReceptions) {
-        bool overlap = false;
-        bool frequencyCollision = false;
-        bool captureEffect = false;
-        bool timingCollision = false; //Collision is acceptable in first part of preamble
-        const LoRaReception *loRaInterference = check_and_cast<const LoRaReception *>(interferingReception);
-
-        simtime_t m_y = (loRaInterference->getStartTime() + loRaInterference->getEndTime())/2;
-        simtime_t d_y = (loRaInterference->getEndTime() - loRaInterference->getStartTime())/2;
-        if(omnetpp::fabs(m_x - m_y) < d_x + d_y)
-        {
-            overlap = true;
-        }
-
-        if(loRaReception->getLoRaCF() == loRaInterference->getLoRaCF())
-        {
-            frequencyCollision = true;
-        }
-
-        W interferenceRSSI_w = loRaInterference->getPower();
-        double interferenceRSSI_mw = interferenceRSSI_w.get()*1000;
-        double interferenceRSSI_dBm = math::mW2dBmW(interferenceRSSI_mw);
-        int interferenceSF = loRaInterference->getLoRaSF();
 
-        /* If difference in power between two signals is greater than threshold, no collision*/
-        if(signalRSSI_dBm - interferenceRSSI_dBm >= nonOrthDelta[receptionSF-7][interferenceSF-7])
-        {
-            captureEffect = true;
-        }
-
-        EV << "[MSDEBUG] Received packet at SF: " << receptionSF << " with power " << signalRSSI_dBm << endl;
-        EV << "[MSDEBUG] Received interference at SF: " << interferenceSF << " with power " << interferenceRSSI_dBm << endl;
-        EV << "[MSDEBUG] Acceptable diff is equal " << nonOrthDelta[receptionSF-7][interferenceSF-7] << endl;
-        EV << "[MSDEBUG] Diff is equal " << signalRSSI_dBm - interferenceRSSI_dBm << endl;
-        if (captureEffect == false)
-        {
-            EV << "[MSDEBUG] Packet is discarded" << endl;
-        } else
-            EV << "[MSDEBUG] Packet is not discarded" << endl;
-
-        /* If last 6 symbols of preamble are received, no collision*/
-        double nPreamble = 8; //from the paper "Do Lora networks..."
-        simtime_t Tsym = (pow(2, loRaReception->getLoRaSF()))/(loRaReception->getLoRaBW().get()/1000)/1000;
-        simtime_t csBegin = loRaReception->getPreambleStartTime() + Tsym * (nPreamble - 6);
-        if(csBegin < loRaInterference->getEndTime())
-        {
-            timingCollision = true;
-        }
-
-        if (overlap && frequencyCollision)
-        {
-            if(alohaChannelModel == true)
-            {
-                if(iAmGateway && (part == IRadioSignal::SIGNAL_PART_DATA || part == IRadioSignal::SIGNAL_PART_WHOLE)) const_cast<LoRaReceiver* >(this)->emit(LoRaReceptionCollision, true);
-                return true;
-            }
-            if(alohaChannelModel == false)
-            {
-                if(captureEffect == false && timingCollision)
-                {
-                    if(iAmGateway && (part == IRadioSignal::SIGNAL_PART_DATA || part == IRadioSignal::SIGNAL_PART_WHOLE)) const_cast<LoRaReceiver* >(this)->emit(LoRaReceptionCollision, true);
-                    return true;
-                }
-            }
+    // The LoRa analog model only creates LoRaReceptions, so the interferers need no checked cast each
+    interferers.clear();
+    for (auto interferingReception : *interferingReceptions) {
+        ASSERT(dynamic_cast<const LoRaReception *>(interferingReception) != nullptr);
+        interferers.add(static_cast<const LoRaReception *>(interferingReception));
+    }
 
-        }
+    /* An interferer destroys the reception when it overlaps it on the same channel, and
+     * (without the ALOHA model) is not captured by the reception: it is within nonOrthDelta of
+     * its power, and it still lasts when the last 6 preamble symbols start ("Do LoRa networks...").
+     * Everything the loop needs is in plain arrays, and no interferer ends it early, so it compiles
+     * into straight-line code the compiler can vectorise.
+     */
+    int64_t start = loRaReception->getStartTime().raw();
+    int64_t end = loRaReception->getEndTime().raw();
+    double centerFrequency = loRaReception->getLoRaCF().get();
+    double power = loRaReception->getPower().get();
+    const double *ratios = captureRatio[loRaReception->getLoRaSF()-7];
+    const int nPreamble = 8;
+    simtime_t Tsym = LoRaAirtime::getSymbolTime(loRaReception->getLoRaSF(), loRaReception->getLoRaBW());
+    int64_t csBegin = (loRaReception->getPreambleStartTime() + Tsym * (nPreamble - 6)).raw();
+    bool aloha = alohaChannelModel;
+
+    const int64_t *startTimes = interferers.startTime.data();
+    const int64_t *endTimes = interferers.endTime.data();
+    const double *centerFrequencies = interferers.centerFrequency.data();
+    const int *spreadFactors = interferers.spreadFactor.data();
+    const double *powers = interferers.power.data();
+    size_t n = interferers.size();
+    int collisions = 0;
+    for (size_t i = 0; i < n; i++) {
+        bool overlap = startTimes[i] < end && start < endTimes[i];
+        bool frequencyCollision = centerFrequencies[i] == centerFrequency;
+        bool captureEffect = power >= powers[i] * ratios[spreadFactors[i]-7];
+        bool timingCollision = csBegin < endTimes[i]; // Collision is acceptable in first part of preamble
+        collisions += overlap & frequencyCollision & (aloha | (!captureEffect & timingCollision));
     }
-    return false;
+    EV_DEBUG << "Reception at SF" << loRaReception->getLoRaSF() << " with " << n << " interferer(s), " << collisions << " of them destroy it" << endl;
+
+    if (collisions == 0)
+        return false;
+    if(iAmGateway && (part == IRadioSignal::SIGNAL_PART_DATA || part == IRadioSignal::SIGNAL_PART_WHOLE)) const_cast<LoRaReceiver* >(this)->emit(LoRaReceptionCollision, true);
+    return true;
 }
 
 const IReceptionDecision *LoRaReceiver::computeReceptionDecision(const IListening *listening, const IReception *reception, IRadioSignal::SignalPart part, const IInterference *interference, const ISnir *snir) const
@@ -268,63 +273,85 @@ const IListeningDecision *LoRaReceiver::computeListeningDecision(const IListenin
     const IRadio *receiver = listening->getReceiver();
     const IRadioMedium *radioMedium = receiver->getMedium();
     const IAnalogModel *analogModel = radioMedium->getAnalogModel();
-    const INoise *noise = analogModel->computeNoise(listening, interference);
-    const ScalarNoise *loRaNoise = check_and_cast<const ScalarNoise *>(noise);
-    W maxPower = loRaNoise->computeMaxPower(listening->getStartTime(), listening->getEndTime());
+    W maxPower = W(NaN);
+    if (auto loRaAnalogModel = dynamic_cast<const LoRaAnalogModel *>(analogModel))
+        maxPower = loRaAnalogModel->computeMaxNoisePower(listening, interference, listening->getStartTime(), listening->getEndTime());
+    else {
+        const INoise *noise = analogModel->computeNoise(listening, interference);
+        const ScalarNoise *loRaNoise = check_and_cast<const ScalarNoise *>(noise);
+        maxPower = loRaNoise->computeMaxPower(listening->getStartTime(), listening->getEndTime());
+        delete noise;
+    }
     bool isListeningPossible = maxPower >= energyDetection;
-    delete noise;
     EV_DEBUG << "Computing whether listening is possible: maximum power = " << maxPower << ", energy detection = " << energyDetection << " -> listening is " << (isListeningPossible ? "possible" : "impossible") << endl;
     return new ListeningDecision(listening, isListeningPossible);
 }
 
 W LoRaReceiver::getSensitivity(const LoRaReception *reception) const
+{
+    return getSensitivity(reception->getLoRaSF(), reception->getLoRaBW());
+}
+
+W LoRaReceiver::getMinRelevantPower(int spreadFactor, Hz bandwidth)
+{
+    // A reception at receptionSF is at least at its sensitivity, and it is only destroyed by an
+    // interferer within nonOrthDelta of it
+    W minPower = getSensitivity(spreadFactor, bandwidth);
+    for (int receptionSF = 7; receptionSF <= 12; receptionSF++) {
+        W minInterferingPower = getSensitivity(receptionSF, bandwidth) / math::dB2fraction(getNonOrthDelta(receptionSF, spreadFactor));
+        minPower = std::min(minPower, minInterferingPower);
+    }
+    return minPower;
+}
+
+W LoRaReceiver::getSensitivity(int spreadFactor, Hz bandwidth)
 {
     //function returns sensitivity -- according to LoRa documentation, it changes with LoRa parameters
     //Sensitivity values from Semtech SX1272/73 datasheet, table 10, Rev 3.1, March 2017
     W sensitivity = W(math::dBmW2mW(-126.5) / 1000);
-    if(reception->getLoRaSF() == 6)
+    if(spreadFactor == 6)
     {
-        if(reception->getLoRaBW() == Hz(125000)) sensitivity = W(math::dBmW2mW(-121) / 1000);
-        if(reception->getLoRaBW() == Hz(250000)) sensitivity = W(math::dBmW2mW(-118) / 1000);
-        if(reception->getLoRaBW() == Hz(500000)) sensitivity = W(math::dBmW2mW(-111) / 1000);
+        if(bandwidth == Hz(125000)) sensitivity = W(math::dBmW2mW(-121) / 1000);
+        if(bandwidth == Hz(250000)) sensitivity = W(math::dBmW2mW(-118) / 1000);
+        if(bandwidth == Hz(500000)) sensitivity = W(math::dBmW2mW(-111) / 1000);
     }
 
-    if (reception->getLoRaSF() == 7)
+    if (spreadFactor == 7)
     {
-        if(reception->getLoRaBW() == Hz(125000)) sensitivity = W(math::dBmW2mW(-124) / 1000);
-        if(reception->getLoRaBW() == Hz(250000)) sensitivity = W(math::dBmW2mW(-122) / 1000);
-        if(reception->getLoRaBW() == Hz(500000)) sensitivity = W(math::dBmW2mW(-116) / 1000);
+        if(bandwidth == Hz(125000)) sensitivity = W(math::dBmW2mW(-124) / 1000);
+        if(bandwidth == Hz(250000)) sensitivity = W(math::dBmW2mW(-122) / 1000);
+        if(bandwidth == Hz(500000)) sensitivity = W(math::dBmW2mW(-116) / 1000);
     }
 
-    if(reception->getLoRaSF() == 8)
+    if(spreadFactor == 8)
     {
-        if(reception->getLoRaBW() == Hz(125000)) sensitivity = W(math::dBmW2mW(-127) / 1000);
-        if(reception->getLoRaBW() == Hz(250000)) sensitivity = W(math::dBmW2mW(-125) / 1000);
-        if(reception->getLoRaBW() == Hz(500000)) sensitivity = W(math::dBmW2mW(-119) / 1000);
+        if(bandwidth == Hz(125000)) sensitivity = W(math::dBmW2mW(-127) / 1000);
+        if(bandwidth == Hz(250000)) sensitivity = W(math::dBmW2mW(-125) / 1000);
+        if(bandwidth == Hz(500000)) sensitivity = W(math::dBmW2mW(-119) / 1000);
     }
-    if(reception->getLoRaSF() == 9)
+    if(spreadFactor == 9)
     {
-        if(reception->getLoRaBW() == Hz(125000)) sensitivity = W(math::dBmW2mW(-130) / 1000);
-        if(reception->getLoRaBW() == Hz(250000)) sensitivity = W(math::dBmW2mW(-128) / 1000);
-        if(reception->getLoRaBW() == Hz(500000)) sensitivity = W(math::dBmW2mW(-122) / 1000);
+        if(bandwidth == Hz(125000)) sensitivity = W(math::dBmW2mW(-130) / 1000);
+        if(bandwidth == Hz(250000)) sensitivity = W(math::dBmW2mW(-128) / 1000);
+        if(bandwidth == Hz(500000)) sensitivity = W(math::dBmW2mW(-122) / 1000);
     }
-    if(reception->getLoRaSF() == 10)
+    if(spreadFactor == 10)
     {
-        if(reception->getLoRaBW() == Hz(125000)) sensitivity = W(math::dBmW2mW(-133) / 1000);
-        if(reception->getLoRaBW() == Hz(250000)) sensitivity = W(math::dBmW2mW(-130) / 1000);
-        if(reception->getLoRaBW() == Hz(500000)) sensitivity = W(math::dBmW2mW(-125) / 1000);
+        if(bandwidth == Hz(125000)) sensitivity = W(math::dBmW2mW(-133) / 1000);
+        if(bandwidth == Hz(250000)) sensitivity = W(math::dBmW2mW(-130) / 1000);
+        if(bandwidth == Hz(500000)) sensitivity = W(math::dBmW2mW(-125) / 1000);
     }
-    if(reception->getLoRaSF() == 11)
+    if(spreadFactor == 11)
     {
-        if(reception->getLoRaBW() == Hz(125000)) sensitivity = W(math::dBmW2mW(-135) / 1000);
-        if(reception->getLoRaBW() == Hz(250000)) sensitivity = W(math::dBmW2mW(-132) / 1000);
-        if(reception->getLoRaBW() == Hz(500000)) sensitivity = W(math::dBmW2mW(-128) / 1000);
+        if(bandwidth == Hz(125000)) sensitivity = W(math::dBmW2mW(-135) / 1000);
+        if(bandwidth == Hz(250000)) sensitivity = W(math::dBmW2mW(-132) / 1000);
+        if(bandwidth == Hz(500000)) sensitivity = W(math::dBmW2mW(-128) / 1000);
     }
-    if(reception->getLoRaSF() == 12)
+    if(spreadFactor == 12)
     {
-        if(reception->getLoRaBW() == Hz(125000)) sensitivity = W(math::dBmW2mW(-137) / 1000);
-        if(reception->getLoRaBW() == Hz(250000)) sensitivity = W(math::dBmW2mW(-135) / 1000);
-        if(reception->getLoRaBW() == Hz(500000)) sensitivity = W(math::dBmW2mW(-129) / 1000);
+        if(bandwidth == Hz(125000)) sensitivity = W(math::dBmW2mW(-137) / 1000);
+        if(bandwidth == Hz(250000)) sensitivity = W(math::dBmW2mW(-135) / 1000);
+        if(bandwidth == Hz(500000)) sensitivity = W(math::dBmW2mW(-129) / 1000);
     }
     return sensitivity;
 }
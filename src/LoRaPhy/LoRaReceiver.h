@@ -57,14 +57,23 @@ private:
 
     simsignal_t LoRaReceptionCollision;
 
-    int nonOrthDelta[6][6] = {
-       {1, -8, -9, -9, -9, -9},
-       {-11, 1, -11, -12, -13, -13},
-       {-15, -13, 1, -13, -14, -15},
-       {-19, -18, -17, 1, -17, -18},
-       {-22, -22, -21, -20, 1, -20},
-       {-25, -25, -25, -24, -23, 1}
+    static const int nonOrthDelta[6][6];
+    double captureRatio[6][6]; // nonOrthDelta as a power ratio, so no reception needs a log
+
+    /* The interferers of one reception, gathered field by field so the collision
+     * test runs as one flat loop over plain arrays. Reused between receptions */
+    struct InterfererBatch {
+        std::vector<int64_t> startTime; // Raw simtime
+        std::vector<int64_t> endTime; // Raw simtime
+        std::vector<double> centerFrequency; // Hz
+        std::vector<int> spreadFactor;
+        std::vector<double> power; // W
+
+        void clear();
+        void add(const LoRaReception *reception);
+        size_t size() const { return startTime.size(); }
     };
+    mutable InterfererBatch interferers;
 
     //statistics
     long numCollisions;
@@ -96,6 +105,13 @@ public:
   virtual const IListeningDecision *computeListeningDecision(const IListening *listening, const IInterference *interference) const override;
 
   W getSensitivity(const LoRaReception *loRaReception) const;
+  static W getSensitivity(int spreadFactor, Hz bandwidth);
+
+  /* Power difference in dB a reception at receptionSF needs over an interferer at interferenceSF to survive */
+  static int getNonOrthDelta(int receptionSF, int interferenceSF) { return nonOrthDelta[receptionSF-7][interferenceSF-7]; }
+  /* Weakest signal at SF that a receiver can still decode or have a reception destroyed by, without the ALOHA model */
+  static W getMinRelevantPower(int spreadFactor, Hz bandwidth);
+  bool isAlohaChannelModel() const { return alohaChannelModel; }
 
   bool isPacketCollided(const IReception *reception, IRadioSignal::SignalPart part, const IInterference *interference) const;
 
@@ -0,0 +1,81 @@
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+// 
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see http://www.gnu.org/licenses/.
+// 
+
+
+
+#include "LoRaShadowingMap.h"
+#include "inet/physicallayer/wireless/common/contract/packetlevel/IMediumLimitCache.h"
+#include <algorithm>
+#include <cmath>
+
+namespace flora_tdma {
+
+void LoRaShadowingMap::generate(const IRadioMedium *medium, double resolution, double decorrelationDistance, double sigma, cRNG *rng)
+{
+    const IMediumLimitCache *mediumLimitCache = medium->getMediumLimitCache();
+    Coord min = mediumLimitCache->getMinConstraintArea();
+    Coord max = mediumLimitCache->getMaxConstraintArea();
+    if (!std::isfinite(min.x) || !std::isfinite(min.y) || !std::isfinite(max.x) || !std::isfinite(max.y))
+        throw cRuntimeError("The shadowing map needs a finite constraint area of the mobility models");
+    generate(min, max, resolution, decorrelationDistance, sigma, rng);
+}
+
+void LoRaShadowingMap::generate(const Coord& min, const Coord& max, double resolution, double decorrelationDistance, double sigma, cRNG *rng)
+{
+    if (!(resolution > 0) || !(decorrelationDistance > 0))
+        throw cRuntimeError("Invalid shadowing map resolution %g m or decorrelation distance %g m", resolution, decorrelationDistance);
+    origin = min;
+    this->resolution = resolution;
+    sizeX = std::max(2, (int)std::ceil((max.x - min.x) / resolution) + 1);
+    sizeY = std::max(2, (int)std::ceil((max.y - min.y) / resolution) + 1);
+    if ((double)sizeX * sizeY > 1e8)
+        throw cRuntimeError("The shadowing map would have %d x %d points, use a coarser resolution", sizeX, sizeY);
+
+    values.resize((size_t)sizeX * sizeY);
+    for (auto& value : values)
+        value = normal(rng, 0, 1);
+
+    // Starting each row and column from an unfiltered value keeps the process stationary with unit variance
+    double rho = std::exp(-resolution / decorrelationDistance);
+    double innovation = std::sqrt(1 - rho * rho);
+    for (int y = 0; y < sizeY; y++) {
+        float *row = &values[(size_t)y * sizeX];
+        for (int x = 1; x < sizeX; x++)
+            row[x] = rho * row[x - 1] + innovation * row[x];
+    }
+    for (int y = 1; y < sizeY; y++) {
+        float *row = &values[(size_t)y * sizeX];
+        const float *previousRow = row - sizeX;
+        for (int x = 0; x < sizeX; x++)
+            row[x] = rho * previousRow[x] + innovation * row[x];
+    }
+    for (auto& value : values)
+        value *= sigma;
+}
+
+double LoRaShadowingMap::getShadowing(const Coord& position) const
+{
+    double fx = std::min(std::max((position.x - origin.x) / resolution, 0.0), (double)(sizeX - 1));
+    double fy = std::min(std::max((position.y - origin.y) / resolution, 0.0), (double)(sizeY - 1));
+    int x = std::min((int)fx, sizeX - 2);
+    int y = std::min((int)fy, sizeY - 2);
+    double dx = fx - x;
+    double dy = fy - y;
+    const float *row = &values[(size_t)y * sizeX + x];
+    const float *nextRow = row + sizeX;
+    return (1 - dy) * ((1 - dx) * row[0] + dx * row[1]) + dy * ((1 - dx) * nextRow[0] + dx * nextRow[1]);
+}
+
+}
@@ -0,0 +1,71 @@
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+// 
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see http://www.gnu.org/licenses/.
+// 
+
+
+
+#ifndef LORAPHY_LORASHADOWINGMAP_H_
+#define LORAPHY_LORASHADOWINGMAP_H_
+
+#include "inet/common/INETDefs.h"
+#include "inet/common/geometry/common/Coord.h"
+#include "inet/physicallayer/wireless/common/contract/packetlevel/IRadioMedium.h"
+#include <vector>
+
+namespace flora_tdma {
+
+using namespace inet;
+using namespace inet::physicallayer;
+
+/**
+ * Spatially correlated log-normal shadowing over the constraint area, after
+ * Gudmundson: the shadowing of two places a distance d apart in x or y is
+ * correlated by exp(-d / decorrelationDistance).
+ *
+ * The map is a grid of independent normal values, run through a first order
+ * autoregressive filter along the rows and then along the columns, which
+ * keeps the variance and gives the exponential correlation. It is made once
+ * and sampled by bilinear interpolation, so a place keeps its shadowing for
+ * the whole run.
+ */
+class LoRaShadowingMap
+{
+  protected:
+    Coord origin;
+    double resolution = NaN; // m
+    int sizeX = 0;
+    int sizeY = 0;
+    std::vector<float> values; // dB, row by row
+
+  public:
+    LoRaShadowingMap() {}
+    virtual ~LoRaShadowingMap() {}
+
+    /** Covers the constraint area of the medium's radios, throws if that is not finite. */
+    virtual void generate(const IRadioMedium *medium, double resolution, double decorrelationDistance, double sigma, cRNG *rng);
+    virtual void generate(const Coord& min, const Coord& max, double resolution, double decorrelationDistance, double sigma, cRNG *rng);
+    bool isEmpty() const { return values.empty(); }
+
+    /** Shadowing in dB at the position, outside the map that of its nearest edge. */
+    virtual double getShadowing(const Coord& position) const;
+    /**
+     * Shadowing in dB of the link between two positions, the same both ways. Both ends
+     * add their own surroundings, scaled so that a link keeps the variance of the map.
+     */
+    double getShadowing(const Coord& a, const Coord& b) const { return (getShadowing(a) + getShadowing(b)) / std::sqrt(2.0); }
+};
+
+}
+
+#endif /* LORAPHY_LORASHADOWINGMAP_H_ */
@@ -0,0 +1,69 @@
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+// 
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see http://www.gnu.org/licenses/.
+// 
+
+
+
+#include "LoRaSpatialGrid.h"
+#include <algorithm>
+
+namespace flora_tdma {
+
+void LoRaSpatialGrid::setCellSize(m cellSize)
+{
+    if (!(cellSize.get() > 0))
+        throw cRuntimeError("Invalid spatial grid cell size: %g m", cellSize.get());
+    clear();
+    this->cellSize = cellSize.get();
+}
+
+void LoRaSpatialGrid::addRadio(const IRadio *radio)
+{
+    const IMobility *mobility = radio->getAntenna()->getMobility();
+    if (mobility->getMaxSpeed() != 0) {
+        mobileRadios.push_back(radio);
+        return;
+    }
+    addRadio(radio, mobility->getCurrentPosition());
+}
+
+void LoRaSpatialGrid::addRadio(const IRadio *radio, const Coord& position)
+{
+    uint64_t key = getCellKey(getCellIndex(position.x), getCellIndex(position.y));
+    cells[key].push_back({radio, position});
+    radioCells[radio] = key;
+}
+
+void LoRaSpatialGrid::removeRadio(const IRadio *radio)
+{
+    auto it = radioCells.find(radio);
+    if (it == radioCells.end()) {
+        mobileRadios.erase(std::remove(mobileRadios.begin(), mobileRadios.end(), radio), mobileRadios.end());
+        return;
+    }
+    std::vector<Entry>& cell = cells[it->second];
+    cell.erase(std::remove_if(cell.begin(), cell.end(), [&] (const Entry& entry) { return entry.radio == radio; }), cell.end());
+    if (cell.empty())
+        cells.erase(it->second);
+    radioCells.erase(it);
+}
+
+void LoRaSpatialGrid::clear()
+{
+    cells.clear();
+    radioCells.clear();
+    mobileRadios.clear();
+}
+
+}
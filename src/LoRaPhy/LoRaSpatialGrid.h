@@ -0,0 +1,102 @@
+//
+// This program is free software: you can redistribute it and/or modify
+// it under the terms of the GNU Lesser General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+// 
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU Lesser General Public License for more details.
+// 
+// You should have received a copy of the GNU Lesser General Public License
+// along with this program.  If not, see http://www.gnu.org/licenses/.
+// 
+
+
+
+#ifndef LORAPHY_LORASPATIALGRID_H_
+#define LORAPHY_LORASPATIALGRID_H_
+
+#include "inet/common/INETDefs.h"
+#include "inet/common/Units.h"
+#include "inet/common/geometry/common/Coord.h"
+#include "inet/mobility/contract/IMobility.h"
+#include "inet/physicallayer/wireless/common/contract/packetlevel/IAntenna.h"
+#include "inet/physicallayer/wireless/common/contract/packetlevel/IRadio.h"
+#include <cmath>
+#include <unordered_map>
+#include <vector>
+
+namespace flora_tdma {
+
+using namespace inet;
+using namespace inet::physicallayer;
+using namespace inet::units::values;
+
+/**
+ * Uniform grid over the x-y plane that finds the radios around a position.
+ *
+ * Stationary radios are hashed into square cells by the position they had
+ * when they were added, so a query only looks at the cells its range
+ * overlaps. Radios that can move are kept aside and always checked at their
+ * current position.
+ */
+class LoRaSpatialGrid
+{
+  protected:
+    struct Entry {
+        const IRadio *radio;
+        Coord position;
+    };
+
+    double cellSize = NaN; // m
+    std::unordered_map<uint64_t, std::vector<Entry>> cells;
+    std::unordered_map<const IRadio *, uint64_t> radioCells; // Stationary radio to its cell
+    std::vector<const IRadio *> mobileRadios;
+
+    int getCellIndex(double coordinate) const { return (int)std::floor(coordinate / cellSize); }
+    static uint64_t getCellKey(int x, int y) { return ((uint64_t)(uint32_t)x << 32) | (uint32_t)y; }
+
+  public:
+    LoRaSpatialGrid() {}
+    virtual ~LoRaSpatialGrid() {}
+
+    /** Changing the cell size empties the grid. */
+    virtual void setCellSize(m cellSize);
+    m getCellSize() const { return m(cellSize); }
+
+    virtual void addRadio(const IRadio *radio);
+    /** Places the radio at the given position, whether it can move or not. */
+    virtual void addRadio(const IRadio *radio, const Coord& position);
+    virtual void removeRadio(const IRadio *radio);
+    virtual void clear();
+    size_t getNumRadios() const { return radioCells.size() + mobileRadios.size(); }
+
+    /** Calls f for every radio within range of the position, in no particular order. */
+    template<typename F>
+    void mapRadios(const Coord& position, m range, F f) const
+    {
+        double r = range.get();
+        double r2 = r * r;
+        int minX = getCellIndex(position.x - r), maxX = getCellIndex(position.x + r);
+        int minY = getCellIndex(position.y - r), maxY = getCellIndex(position.y + r);
+        for (int x = minX; x <= maxX; x++) {
+            for (int y = minY; y <= maxY; y++) {
+                auto it = cells.find(getCellKey(x, y));
+                if (it == cells.end())
+                    continue;
+                for (const Entry& entry : it->second)
+                    if (entry.position.sqrdist(position) <= r2)
+                        f(entry.radio);
+            }
+        }
+        for (const IRadio *radio : mobileRadios)
+            if (radio->getAntenna()->getMobility()->getCurrentPosition().sqrdist(position) <= r2)
+                f(radio);
+    }
+};
+
+}
+
+#endif /* LORAPHY_LORASPATIALGRID_H_ */
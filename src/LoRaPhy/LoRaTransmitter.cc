@@ -61,20 +61,16 @@ const ITransmission *LoRaTransmitter::createTransmission(const IRadio *transmitt
     EV << macFrame->getDetailStringRepresentation(evFlags) << endl;
     const auto &frame = macFrame->peekAtFront<LoRaPhyPreamble>();
 
-    int nPreamble = 8;
-    simtime_t Tsym = (pow(2, frame->getSpreadFactor()))/(frame->getBandwidth().get()/1000);
-    simtime_t Tpreamble = (nPreamble + 4.25) * Tsym / 1000;
-
-    int payloadBytes = 0;
-    if(iAmGateway) payloadBytes = 128; // Calculated for now
-    else payloadBytes = payloaddatasize;
-    int payloadSymbNb = 8;
-    payloadSymbNb += std::ceil((8*payloadBytes - 4*frame->getSpreadFactor() + 28 + 16 - 20*0)/(4*(frame->getSpreadFactor()-2*0)))*(frame->getCodeRendundance() + 4);
-    if(payloadSymbNb < 8) payloadSymbNb = 8;
-    simtime_t Theader = 0.5 * (8+payloadSymbNb) * Tsym / 1000;
-    simtime_t Tpayload = 0.5 * (8+payloadSymbNb) * Tsym / 1000;
-
-    const simtime_t duration = Tpreamble + Theader + Tpayload;
+    // Beacons and uplinks vary in size, so the airtime follows what is actually sent
+    b payloadLength = macFrame->getTotalLength() - frame->getChunkLength();
+    int payloadBytes = std::max((int)((payloadLength.get() + 7) / 8), payloaddatasize);
+
+    LoRaAirtime::Airtime airtime = LoRaAirtime::computeAirtime(frame->getSpreadFactor(), frame->getBandwidth(), frame->getCodeRendundance(), payloadBytes, frame->getUseHeader());
+    const simtime_t Tpreamble = airtime.preamble;
+    const simtime_t Theader = airtime.header;
+    const simtime_t Tpayload = airtime.payload;
+
+    const simtime_t duration = airtime.getTotal();
     const simtime_t endTime = startTime + duration;
     IMobility *mobility = transmitter->getAntenna()->getMobility();
     const Coord startPosition = mobility->getCurrentPosition();
@@ -19,6 +19,7 @@
 #include "inet/physicallayer/wireless/common/base/packetlevel/FlatTransmitterBase.h"
 #include "LoRaModulation.h"
 #include "LoRaTransmission.h"
+#include "LoRaAirtime.h"
 #include "LoRa/LoRaRadio.h"
 #include "LoRa/LoRaMacFrame_m.h"
 
@@ -34,7 +35,7 @@ class LoRaTransmitter : public FlatTransmitterBase {
     private:
 
         bool iAmGateway;
-        int payloaddatasize;
+        int payloaddatasize; // Shortest payload the airtime is computed for, in bytes
 
         simsignal_t LoRaTransmissionCreated;
 